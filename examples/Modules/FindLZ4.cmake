@@ -0,0 +1,16 @@
+# Try to find LZ4 Library
+
+find_package(PkgConfig)
+pkg_check_modules(PC_LZ4 QUIET liblz4)
+
+find_path(LZ4_INCLUDE_DIR
+	NAMES lz4.h
+	PATHS ${PC_LZ4_INCLUDE_DIRS})
+
+find_library(LZ4_LIBRARY
+	NAMES lz4 liblz4
+	PATHS ${PC_LZ4_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR)
+mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARY)
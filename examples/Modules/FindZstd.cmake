@@ -0,0 +1,16 @@
+# Try to find Zstandard Library
+
+find_package(PkgConfig)
+pkg_check_modules(PC_Zstd QUIET libzstd)
+
+find_path(Zstd_INCLUDE_DIR
+	NAMES zstd.h
+	PATHS ${PC_Zstd_INCLUDE_DIRS})
+
+find_library(Zstd_LIBRARY
+	NAMES zstd libzstd
+	PATHS ${PC_Zstd_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd DEFAULT_MSG Zstd_LIBRARY Zstd_INCLUDE_DIR)
+mark_as_advanced(Zstd_INCLUDE_DIR Zstd_LIBRARY)
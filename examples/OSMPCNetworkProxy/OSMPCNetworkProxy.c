@@ -50,261 +50,2350 @@ FILE* OSMPCNetworkProxy_private_log_file;
 #endif
 
 /*
- * Binary Data Accessors
+ * TCP Proxy Communication
+ *
+ * Messages are framed by their size as a 4 byte integer, and are sent
+ * with Nagle's algorithm disabled, as each message is complete when
+ * sent and would otherwise wait for the peer's delayed ACK.
  */
 
-void* decode_integer_to_pointer(fmi2Integer hi,fmi2Integer lo)
+/* Disables Nagle's algorithm and applies the configured socket buffer sizes (0 keeps the system default) */
+void configure_tcp_proxy_socket(OSMPCNetworkProxy component, SOCKET s)
+{
+    int nodelay = 1;
+    int sndbuf = component->integer_vars[FMI_INTEGER_SEND_BUFFER_SIZE_IDX];
+    int rcvbuf = component->integer_vars[FMI_INTEGER_RECV_BUFFER_SIZE_IDX];
+
+    if (setsockopt(s,IPPROTO_TCP,TCP_NODELAY,(const char*)&nodelay,sizeof(nodelay)) != 0)
+        normal_log(component,"NET","Failed to disable Nagle's algorithm on socket");
+    if (sndbuf > 0 && setsockopt(s,SOL_SOCKET,SO_SNDBUF,(const char*)&sndbuf,sizeof(sndbuf)) != 0)
+        normal_log(component,"NET","Failed to set socket send buffer size to %d",sndbuf);
+    if (rcvbuf > 0 && setsockopt(s,SOL_SOCKET,SO_RCVBUF,(const char*)&rcvbuf,sizeof(rcvbuf)) != 0)
+        normal_log(component,"NET","Failed to set socket receive buffer size to %d",rcvbuf);
+}
+
+/* Sends the size, an optional header and the payload of a message in one call, continuing after partial sends */
+int send_tcp_frame(OSMPCNetworkProxy component, const void* header, fmi2Integer headersize, const void* payload, fmi2Integer payloadsize)
 {
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.base.lo=lo;
-    myaddr.base.hi=hi;
-    return (void*)(myaddr.address);
-#elif PTRDIFF_MAX == INT32_MAX
-    return (void*)(lo);
+    fmi2Integer framesize = headersize + payloadsize;
+#ifdef _WIN32
+    WSABUF bufs[3];
+    WSABUF* next = bufs;
+    DWORD count = 0;
+    DWORD sent;
+    bufs[count].buf = (char*)&framesize;
+    bufs[count++].len = sizeof(framesize);
+    if (headersize > 0) {
+        bufs[count].buf = (char*)header;
+        bufs[count++].len = headersize;
+    }
+    if (payloadsize > 0) {
+        bufs[count].buf = (char*)payload;
+        bufs[count++].len = payloadsize;
+    }
+    while (count > 0) {
+        if (WSASend(component->tcp_proxy_socket,next,count,&sent,0,NULL,NULL) != 0) {
+            normal_log(component,"NET","Failed to send message with size %d: %d",framesize,WSAGetLastError());
+            return 0;
+        }
+        while (count > 0 && sent >= next->len) {
+            sent -= next->len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->buf += sent;
+            next->len -= sent;
+        }
+    }
 #else
-#error "Cannot determine 32bit or 64bit environment!"
+    struct iovec iov[3];
+    struct msghdr msg;
+    ssize_t sent;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = iov;
+    iov[msg.msg_iovlen].iov_base = &framesize;
+    iov[msg.msg_iovlen++].iov_len = sizeof(framesize);
+    if (headersize > 0) {
+        iov[msg.msg_iovlen].iov_base = (void*)header;
+        iov[msg.msg_iovlen++].iov_len = headersize;
+    }
+    if (payloadsize > 0) {
+        iov[msg.msg_iovlen].iov_base = (void*)payload;
+        iov[msg.msg_iovlen++].iov_len = payloadsize;
+    }
+    while (msg.msg_iovlen > 0) {
+        sent = sendmsg(component->tcp_proxy_socket,&msg,0);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            normal_log(component,"NET","Failed to send message with size %d: %d (%s)",framesize,errno,strerror(errno));
+            return 0;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov[0].iov_len) {
+            sent -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (char*)msg.msg_iov[0].iov_base + sent;
+            msg.msg_iov[0].iov_len -= sent;
+        }
+    }
 #endif
+    return 1;
 }
 
-void encode_pointer_to_integer(const void* ptr,fmi2Integer* hi,fmi2Integer* lo)
+/*
+ * Wire Format Negotiation and Compression
+ *
+ * If the compression parameter is set, both sides exchange a hello
+ * right after connecting, and from then on every message starts with
+ * a message header giving its codec and uncompressed size.  The hello
+ * lists the codecs the FMU can decode (as compiled in via FMU_LZ4 and
+ * FMU_ZSTD), and each side compresses its messages with the codec
+ * named by its compression parameter (none, lz4 or zstd) if the peer
+ * can decode it, and sends them uncompressed otherwise.  Both sides
+ * have to set compression, as the plain wire format has no hello.
+ *
+ * Messages smaller than compressionThreshold, or that do not get
+ * smaller, are sent uncompressed.  The compression.ratio output gives
+ * the ratio of uncompressed to sent bytes, and compression.time the
+ * time spent compressing and decompressing, over all messages so far.
+ */
+
+#define WIRE_MAGIC 0x504D534FU
+#define WIRE_VERSION 1
+#define WIRE_CODEC_NONE 0
+#define WIRE_CODEC_LZ4 1
+#define WIRE_CODEC_ZSTD 2
+
+#ifndef FMU_DEFAULT_COMPRESSION_THRESHOLD
+#define FMU_DEFAULT_COMPRESSION_THRESHOLD 4096
+#endif
+#ifndef FMU_ZSTD_LEVEL
+#define FMU_ZSTD_LEVEL 1
+#endif
+
+double osmp_time_now()
 {
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.address=(unsigned long long)(ptr);
-    *hi=myaddr.base.hi;
-    *lo=myaddr.base.lo;
-#elif PTRDIFF_MAX == INT32_MAX
-    *hi=0;
-    *lo=(int)(ptr);
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart/(double)frequency.QuadPart;
 #else
-#error "Cannot determine 32bit or 64bit environment!"
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (double)now.tv_sec + now.tv_nsec*1e-9;
+#endif
+}
+
+int wire_format_enabled(OSMPCNetworkProxy component)
+{
+    return component->string_vars[FMI_STRING_COMPRESSION_IDX] != NULL && component->string_vars[FMI_STRING_COMPRESSION_IDX][0] != '\0';
+}
+
+/* Returns the codec named by the compression parameter, or -1 if unknown or not compiled in */
+int configured_wire_codec(OSMPCNetworkProxy component)
+{
+    const char* name = component->string_vars[FMI_STRING_COMPRESSION_IDX];
+    if (0==strcmp(name,"none"))
+        return WIRE_CODEC_NONE;
+#ifdef FMU_LZ4
+    if (0==strcmp(name,"lz4"))
+        return WIRE_CODEC_LZ4;
+#endif
+#ifdef FMU_ZSTD
+    if (0==strcmp(name,"zstd"))
+        return WIRE_CODEC_ZSTD;
+#endif
+    return -1;
+}
+
+unsigned int supported_wire_codecs()
+{
+    unsigned int codecs = 1U << WIRE_CODEC_NONE;
+#ifdef FMU_LZ4
+    codecs |= 1U << WIRE_CODEC_LZ4;
+#endif
+#ifdef FMU_ZSTD
+    codecs |= 1U << WIRE_CODEC_ZSTD;
+#endif
+    return codecs;
+}
+
+/* Exchanges hellos on a new connection, choosing the codec for sent messages */
+int negotiate_wire_format(OSMPCNetworkProxy component)
+{
+    OSMPCNetworkProxyWireHello hello, peer;
+    int codec;
+
+    if (!wire_format_enabled(component))
+        return 1;
+
+    hello.magic = WIRE_MAGIC;
+    hello.version = WIRE_VERSION;
+    hello.codecs = supported_wire_codecs();
+    if (send(component->tcp_proxy_socket,(const char*)&hello,sizeof(hello),0) != sizeof(hello) ||
+        recv(component->tcp_proxy_socket,(char*)&peer,sizeof(peer),MSG_WAITALL) != sizeof(peer)) {
+        normal_log(component,"NET","Failed to exchange wire format hello");
+        return 0;
+    }
+    if (peer.magic != WIRE_MAGIC || peer.version != WIRE_VERSION) {
+        normal_log(component,"NET","Peer does not use the negotiated wire format (magic %08X, version %u); compression has to be set on both sides",peer.magic,peer.version);
+        return 0;
+    }
+
+    codec = configured_wire_codec(component);
+    component->wire_send_codec = (codec >= 0 && (peer.codecs & (1U << codec))) ? codec : WIRE_CODEC_NONE;
+    component->wire_negotiated = 1;
+    normal_log(component,"NET","Negotiated wire format, sending with codec %d (peer decodes %08X)",component->wire_send_codec,peer.codecs);
+    return 1;
+}
+
+/* Ensures the scratch buffer for compressed data holds at least size bytes */
+int ensure_compress_buffer(OSMPCNetworkProxy component, size_t size)
+{
+    if (size > component->compress_capacity) {
+        size_t capacity = component->compress_capacity > 0 ? component->compress_capacity : 4096;
+        while (capacity < size)
+            capacity *= 2;
+        free(component->compress_buffer);
+        component->compress_buffer = malloc(capacity);
+        component->compress_capacity = component->compress_buffer != NULL ? capacity : 0;
+    }
+    return component->compress_buffer != NULL;
+}
+
+/* Compresses into the scratch buffer, returning the compressed size, or 0 if not worthwhile */
+size_t compress_message(OSMPCNetworkProxy component, int codec, const void* buffer, fmi2Integer buffersize)
+{
+    size_t compressed = 0;
+
+    switch (codec) {
+#ifdef FMU_LZ4
+    case WIRE_CODEC_LZ4:
+        if (ensure_compress_buffer(component,LZ4_compressBound(buffersize))) {
+            int rc = LZ4_compress_default((const char*)buffer,component->compress_buffer,buffersize,(int)component->compress_capacity);
+            compressed = rc > 0 ? rc : 0;
+        }
+        break;
+#endif
+#ifdef FMU_ZSTD
+    case WIRE_CODEC_ZSTD:
+        if (component->zstd_cctx == NULL)
+            component->zstd_cctx = ZSTD_createCCtx();
+        if (component->zstd_cctx != NULL && ensure_compress_buffer(component,ZSTD_compressBound(buffersize))) {
+            size_t rc = ZSTD_compressCCtx(component->zstd_cctx,component->compress_buffer,component->compress_capacity,buffer,buffersize,FMU_ZSTD_LEVEL);
+            compressed = ZSTD_isError(rc) ? 0 : rc;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    return compressed < (size_t)buffersize ? compressed : 0;
+}
+
+/* Decompresses from the scratch buffer into data, returning whether exactly size bytes resulted */
+int decompress_message(OSMPCNetworkProxy component, int codec, size_t compressed, char* data, fmi2Integer size)
+{
+    switch (codec) {
+#ifdef FMU_LZ4
+    case WIRE_CODEC_LZ4:
+        return LZ4_decompress_safe(component->compress_buffer,data,(int)compressed,size) == size;
 #endif
+#ifdef FMU_ZSTD
+    case WIRE_CODEC_ZSTD:
+        if (component->zstd_dctx == NULL)
+            component->zstd_dctx = ZSTD_createDCtx();
+        return component->zstd_dctx != NULL && ZSTD_decompressDCtx(component->zstd_dctx,data,size,component->compress_buffer,compressed) == (size_t)size;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Publishes compression counters, in pipelined operation those copied into the collected slot */
+void update_compression_outputs(OSMPCNetworkProxy component, unsigned long long bytes_in, unsigned long long bytes_out, double time)
+{
+    component->real_vars[FMI_REAL_COMPRESSION_RATIO_IDX] = bytes_out > 0 ? (double)bytes_in/(double)bytes_out : 1.0;
+    component->real_vars[FMI_REAL_COMPRESSION_TIME_IDX] = time;
 }
 
+/* Sends a message in the negotiated wire format, if any */
+int send_tcp_message(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
+{
+    OSMPCNetworkProxyWireHeader header;
+    size_t compressed = 0;
+
+    if (!component->wire_negotiated)
+        return send_tcp_frame(component,NULL,0,buffer,buffersize);
+
+    header.codec = WIRE_CODEC_NONE;
+    header.size = buffersize > 0 ? buffersize : 0;
+    if (component->wire_send_codec != WIRE_CODEC_NONE && buffersize > 0 && buffersize >= component->compression_threshold) {
+        double start = osmp_time_now();
+        compressed = compress_message(component,component->wire_send_codec,buffer,buffersize);
+        component->compression_time += osmp_time_now() - start;
+        if (compressed > 0)
+            header.codec = component->wire_send_codec;
+    }
+    component->compression_bytes_in += header.size;
+    component->compression_bytes_out += compressed > 0 ? compressed : header.size;
+
+    if (compressed > 0)
+        return send_tcp_frame(component,&header,sizeof(header),component->compress_buffer,(fmi2Integer)compressed);
+    return send_tcp_frame(component,&header,sizeof(header),buffer,header.size);
+}
 
 /*
- * TCP Proxy Communication
+ * Connection Establishment
+ *
+ * Connections are established without blocking the step for longer
+ * than configured:  The connecting side issues a non-blocking connect,
+ * and the listening side only accepts once a peer is waiting.  Each
+ * step waits at most connectTimeout milliseconds for this (negative
+ * values wait without limit, like a blocking connect or accept), and a
+ * step that finds no peer continues without exchanging data.  After a
+ * failed attempt, the next one is delayed by reconnectBackoff
+ * milliseconds, doubling with each further failure up to
+ * reconnectBackoffMax, so that a missing peer neither stalls the
+ * co-simulation nor floods the log.  Established connections are
+ * switched back to blocking mode for the message exchange.
  */
 
+#ifndef FMU_DEFAULT_RECONNECT_BACKOFF
+#define FMU_DEFAULT_RECONNECT_BACKOFF 100
+#endif
+#ifndef FMU_DEFAULT_RECONNECT_BACKOFF_MAX
+#define FMU_DEFAULT_RECONNECT_BACKOFF_MAX 10000
+#endif
+
+int set_socket_blocking(SOCKET s, int blocking)
+{
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    return ioctlsocket(s,FIONBIO,&mode) == 0;
+#else
+    int flags = fcntl(s,F_GETFL,0);
+    return flags >= 0 && fcntl(s,F_SETFL,blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) == 0;
+#endif
+}
+
+int socket_would_block()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Waits up to connectTimeout for the events on the socket, returning 1 if ready, 0 on timeout and -1 on errors */
+int wait_tcp_proxy_socket(OSMPCNetworkProxy component, SOCKET s, short events)
+{
+    struct pollfd fd;
+    int timeout = component->integer_vars[FMI_INTEGER_CONNECT_TIMEOUT_IDX];
+    int rc;
+
+    fd.fd = s;
+    fd.events = events;
+    fd.revents = 0;
+#ifdef _WIN32
+    rc = WSAPoll(&fd,1,timeout < 0 ? -1 : timeout);
+#else
+    do {
+        rc = poll(&fd,1,timeout < 0 ? -1 : timeout);
+    } while (rc < 0 && errno == EINTR);
+#endif
+    return rc > 0 ? 1 : rc;
+}
+
+/* Checks whether the backoff after failed attempts allows a new connection attempt */
+int tcp_proxy_retry_due(OSMPCNetworkProxy component)
+{
+    return component->tcp_proxy_failures == 0 || osmp_time_now() >= component->tcp_proxy_retry_time;
+}
+
+/* Delays the next connection attempt after a failure, doubling the delay up to the maximum */
+void schedule_tcp_proxy_retry(OSMPCNetworkProxy component)
+{
+    fmi2Integer backoff = component->integer_vars[FMI_INTEGER_RECONNECT_BACKOFF_IDX];
+    fmi2Integer backoff_max = component->integer_vars[FMI_INTEGER_RECONNECT_BACKOFF_MAX_IDX];
+    double maximum = (backoff_max > 0 ? backoff_max : FMU_DEFAULT_RECONNECT_BACKOFF_MAX) / 1000.0;
+    double delay = component->tcp_proxy_failures == 0 ? (backoff > 0 ? backoff : FMU_DEFAULT_RECONNECT_BACKOFF) / 1000.0 : component->tcp_proxy_retry_delay * 2.0;
+
+    if (delay > maximum)
+        delay = maximum;
+    component->tcp_proxy_failures++;
+    component->tcp_proxy_retry_delay = delay;
+    component->tcp_proxy_retry_time = osmp_time_now() + delay;
+    normal_log(component,"NET","Connection attempt %d failed, retrying in %.0f ms",component->tcp_proxy_failures,delay*1000.0);
+}
+
+/* Switches a new connection to blocking mode and negotiates the wire format, resetting the backoff on success */
+int complete_tcp_proxy_connection(OSMPCNetworkProxy component)
+{
+    if (!set_socket_blocking(component->tcp_proxy_socket,1) || !negotiate_wire_format(component)) {
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_socket);
+#else
+        close(component->tcp_proxy_socket);
+#endif
+        component->tcp_proxy_socket=INVALID_SOCKET;
+        schedule_tcp_proxy_retry(component);
+        return 0;
+    }
+    if (component->tcp_proxy_failures > 0)
+        normal_log(component,"NET","Connected after %d failed attempts",component->tcp_proxy_failures);
+    component->tcp_proxy_failures = 0;
+    component->tcp_proxy_retry_delay = 0.0;
+    return 1;
+}
+
 #ifdef FMU_LISTEN
 int ensure_tcp_proxy_listen(OSMPCNetworkProxy component)
 {
-    struct addrinfo hints;
-    struct addrinfo *result;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    int rc;
+
+    if (component->tcp_proxy_listen_socket != INVALID_SOCKET)
+        return 1;
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICHOST|AI_PASSIVE;
+    hints.ai_addrlen=0;
+    hints.ai_canonname=0;
+    hints.ai_addr=0;
+    hints.ai_next=0;
+
+    normal_log(component,"NET","Listening on %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
+    rc=getaddrinfo(component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX],&hints,&result);
+    if (rc!=0 || !result) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error getting listening address: %d",WSAGetLastError());
+#else
+        normal_log(component,"NET","Error getting listening address: %d (%s)",rc,gai_strerror(rc));
+#endif
+        return 0;
+    }
+
+    component->tcp_proxy_listen_socket = socket(result->ai_family,SOCK_STREAM,IPPROTO_TCP);
+    if (component->tcp_proxy_listen_socket == INVALID_SOCKET) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error setting up Socket: %d",WSAGetLastError());
+#else
+        normal_log(component,"NET","Error setting up Socket: %d (%s)",errno,strerror(errno));
+#endif
+        freeaddrinfo(result);
+        return 0;
+    }
+
+    configure_tcp_proxy_socket(component,component->tcp_proxy_listen_socket);
+#ifndef _WIN32
+    /* Connections closed by this side linger in TIME_WAIT, which must not block binding again */
+    {
+        int reuse = 1;
+        setsockopt(component->tcp_proxy_listen_socket,SOL_SOCKET,SO_REUSEADDR,(const char*)&reuse,sizeof(reuse));
+    }
+#endif
+    rc = bind(component->tcp_proxy_listen_socket,result->ai_addr,result->ai_addrlen);
+
+    if (rc != 0) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error setting up Socket Bind: %d",WSAGetLastError());
+#else
+        normal_log(component,"NET","Error setting up Socket Bind: %d (%s)",errno,strerror(errno));
+#endif
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_listen_socket);
+#else
+        close(component->tcp_proxy_listen_socket);
+#endif
+        component->tcp_proxy_listen_socket=INVALID_SOCKET;
+        freeaddrinfo(result);
+        return 0;
+    }
+
+    freeaddrinfo(result);
+    return 1;
+}
+
+void close_tcp_proxy_listen(OSMPCNetworkProxy component)
+{
+    if (component->tcp_proxy_listen_socket!=INVALID_SOCKET) {
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_listen_socket);
+#else
+        close(component->tcp_proxy_listen_socket);
+#endif
+        component->tcp_proxy_listen_socket=INVALID_SOCKET;
+    }
+    component->tcp_proxy_listening=0;
+}
+
+int ensure_tcp_proxy_connection(OSMPCNetworkProxy component)
+{
+    int rc;
+
+    if (component->tcp_proxy_socket != INVALID_SOCKET)
+        return 1;
+    if (!tcp_proxy_retry_due(component))
+        return 0;
+
+    if (!ensure_tcp_proxy_listen(component)) {
+        schedule_tcp_proxy_retry(component);
+        return 0;
+    }
+
+    if (!component->tcp_proxy_listening) {
+        normal_log(component,"NET","Listening on %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
+        rc=listen(component->tcp_proxy_listen_socket,SOMAXCONN);
+        if (rc!=0 || !set_socket_blocking(component->tcp_proxy_listen_socket,0)) {
+#ifdef _WIN32
+            normal_log(component,"NET","Error listening on socket: %d",WSAGetLastError());
+            closesocket(component->tcp_proxy_listen_socket);
+#else
+            normal_log(component,"NET","Error listening on socket: %d (%s)",errno,strerror(errno));
+            close(component->tcp_proxy_listen_socket);
+#endif
+            component->tcp_proxy_listen_socket=INVALID_SOCKET;
+            schedule_tcp_proxy_retry(component);
+            return 0;
+        }
+        component->tcp_proxy_listening = 1;
+    }
+
+    /* Only accept once a peer is waiting, for at most connectTimeout */
+    rc = wait_tcp_proxy_socket(component,component->tcp_proxy_listen_socket,POLLIN);
+    if (rc == 0)
+        return 0;
+    if (rc > 0) {
+        component->tcp_proxy_socket = accept(component->tcp_proxy_listen_socket,NULL,NULL);
+        if (component->tcp_proxy_socket == INVALID_SOCKET && socket_would_block())
+            return 0;
+    }
+    if (component->tcp_proxy_socket == INVALID_SOCKET) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error accepting on Socket: %d",WSAGetLastError());
+#else
+        normal_log(component,"NET","Error accepting on Socket: %d (%s)",errno,strerror(errno));
+#endif
+        close_tcp_proxy_listen(component);
+        schedule_tcp_proxy_retry(component);
+        return 0;
+    }
+
+    configure_tcp_proxy_socket(component,component->tcp_proxy_socket);
+    return complete_tcp_proxy_connection(component);
+}
+
+void close_tcp_proxy_connection(OSMPCNetworkProxy component)
+{
+    if (component->tcp_proxy_socket!=INVALID_SOCKET) {
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_socket);
+#else
+        close(component->tcp_proxy_socket);
+#endif
+        component->tcp_proxy_socket=INVALID_SOCKET;
+        component->wire_negotiated=0;
+    }
+}
+
+/*
+ * Broadcast Server
+ *
+ * With maxClients set to N > 0, the listening proxy accepts up to N
+ * clients instead of exactly one, and sends each input to all of them
+ * (receiving is not supported in this mode).  Sockets are non-blocking:
+ * Each step accepts pending connections, queues the input for every
+ * client, and sends as much as each client takes without waiting.  If
+ * the queue of a client already holds clientQueueLength messages, the
+ * backpressure parameter decides what happens:
+ *
+ * - 0 (drop oldest):  The oldest message not yet partially sent is dropped.
+ * - 1 (block):  The step waits until the client has taken a message.
+ * - 2 (disconnect):  The client is disconnected.
+ *
+ * Each input is framed as for a single client and copied only once,
+ * with the queues sharing it by reference count.  Released messages are
+ * kept on a free list and reused by later steps, so that steady-state
+ * steps do not allocate.  Readiness is polled
+ * via epoll on Linux, with client sockets registered edge-triggered, and
+ * via poll elsewhere.  Per-client statistics are logged when a client
+ * disconnects, and the clients output gives the number of clients.
+ */
+
+#define BACKPRESSURE_DROP_OLDEST 0
+#define BACKPRESSURE_BLOCK 1
+#define BACKPRESSURE_DISCONNECT 2
+
+#ifndef FMU_DEFAULT_CLIENT_QUEUE_LENGTH
+#define FMU_DEFAULT_CLIENT_QUEUE_LENGTH 4
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define BROADCAST_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define BROADCAST_SEND_FLAGS 0
+#endif
+
+/* Returns a message with room for size bytes of data, reusing a released one if possible */
+OSMPCNetworkProxyBroadcastMessage* acquire_broadcast_message(OSMPCNetworkProxy component, size_t size)
+{
+    OSMPCNetworkProxyBroadcastMessage** link = &component->broadcast_free;
+    OSMPCNetworkProxyBroadcastMessage* message;
+
+    while (*link != NULL && (*link)->capacity < size)
+        link = &(*link)->next;
+    /* If none is large enough, replace one instead of growing the free list */
+    if (*link == NULL)
+        link = &component->broadcast_free;
+    message = *link;
+    if (message != NULL) {
+        *link = message->next;
+        if (message->capacity >= size)
+            return message;
+        free(message);
+    }
+    message = malloc(sizeof(OSMPCNetworkProxyBroadcastMessage)+size);
+    if (message != NULL)
+        message->capacity = size;
+    return message;
+}
+
+void release_broadcast_message(OSMPCNetworkProxy component, OSMPCNetworkProxyBroadcastMessage* message)
+{
+    if (--message->refs == 0) {
+        message->next = component->broadcast_free;
+        component->broadcast_free = message;
+    }
+}
+
+void disconnect_broadcast_client(OSMPCNetworkProxy component, OSMPCNetworkProxyClient* client, const char* reason)
+{
+    int i;
+
+    normal_log(component,"NET","Client %d (%s) disconnected (%s): %llu messages (%llu bytes) sent, %llu dropped, %llu blocked steps, max queue %d",
+        client->id,client->address,reason,client->messages_sent,client->bytes_sent,client->messages_dropped,client->blocked_steps,client->max_queued);
+#ifdef _WIN32
+    closesocket(client->socket);
+#else
+    close(client->socket);
+#endif
+    client->socket = INVALID_SOCKET;
+    for (i=0;i<client->queue_count;i++)
+        release_broadcast_message(component,client->queue[(client->queue_head+i) % component->broadcast_queue_length]);
+    client->queue_head = 0;
+    client->queue_count = 0;
+    client->queue_offset = 0;
+    component->integer_vars[FMI_INTEGER_CLIENTS_IDX]--;
+}
+
+/* Sends queued messages until the client's socket would block */
+void flush_broadcast_client(OSMPCNetworkProxy component, OSMPCNetworkProxyClient* client)
+{
+    while (client->socket != INVALID_SOCKET && client->queue_count > 0) {
+        OSMPCNetworkProxyBroadcastMessage* message = client->queue[client->queue_head];
+        int sent = send(client->socket,message->data+client->queue_offset,(int)(message->size-client->queue_offset),BROADCAST_SEND_FLAGS);
+        if (sent < 0) {
+            if (socket_would_block())
+                return;
+#ifndef _WIN32
+            if (errno == EINTR)
+                continue;
+#endif
+            disconnect_broadcast_client(component,client,"send failed");
+            return;
+        }
+        client->queue_offset += sent;
+        client->bytes_sent += sent;
+        if (client->queue_offset == message->size) {
+            release_broadcast_message(component,message);
+            client->queue_head = (client->queue_head+1) % component->broadcast_queue_length;
+            client->queue_count--;
+            client->queue_offset = 0;
+            client->messages_sent++;
+        }
+    }
+}
+
+/* Discards anything clients send, detecting closed connections */
+void drain_broadcast_client(OSMPCNetworkProxy component, OSMPCNetworkProxyClient* client)
+{
+    char scratch[256];
+    for (;;) {
+        int received = recv(client->socket,scratch,sizeof(scratch),0);
+        if (received > 0)
+            continue;
+        if (received < 0 && socket_would_block())
+            return;
+#ifndef _WIN32
+        if (received < 0 && errno == EINTR)
+            continue;
+#endif
+        disconnect_broadcast_client(component,client,received == 0 ? "closed by peer" : "receive failed");
+        return;
+    }
+}
+
+void accept_broadcast_clients(OSMPCNetworkProxy component)
+{
+    for (;;) {
+        struct sockaddr_storage address;
+        socklen_t address_length = sizeof(address);
+        OSMPCNetworkProxyClient* client = NULL;
+        OSMPCNetworkProxyBroadcastMessage** queue;
+        char host[48], port[16];
+        int i;
+        SOCKET s = accept(component->tcp_proxy_listen_socket,(struct sockaddr*)&address,&address_length);
+        if (s == INVALID_SOCKET)
+            return;
+
+        for (i=0;i<component->broadcast_max_clients && client == NULL;i++)
+            if (component->broadcast_clients[i].socket == INVALID_SOCKET)
+                client = &component->broadcast_clients[i];
+        if (client == NULL || !set_socket_blocking(s,0)) {
+            normal_log(component,"NET","Rejecting client, %s",client == NULL ? "maximum number of clients reached" : "failed to make socket non-blocking");
+#ifdef _WIN32
+            closesocket(s);
+#else
+            close(s);
+#endif
+            continue;
+        }
+#ifdef __linux__
+        {
+            struct epoll_event event;
+            event.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+            event.data.u32 = (uint32_t)(client - component->broadcast_clients) + 1;
+            if (epoll_ctl(component->broadcast_epoll,EPOLL_CTL_ADD,s,&event) != 0) {
+                normal_log(component,"NET","Rejecting client, failed to register with epoll: %d (%s)",errno,strerror(errno));
+                close(s);
+                continue;
+            }
+        }
+#endif
+        configure_tcp_proxy_socket(component,s);
+        if (getnameinfo((struct sockaddr*)&address,address_length,host,sizeof(host),port,sizeof(port),NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+            strcpy(host,"?");
+            strcpy(port,"?");
+        }
+        queue = client->queue;
+        memset(client,0,sizeof(*client));
+        client->queue = queue;
+        client->socket = s;
+        client->id = ++component->broadcast_next_id;
+        snprintf(client->address,sizeof(client->address),"%s:%s",host,port);
+        client->address[sizeof(client->address)-1] = '\0';
+        component->integer_vars[FMI_INTEGER_CLIENTS_IDX]++;
+        normal_log(component,"NET","Client %d connected from %s",client->id,client->address);
+    }
+}
+
+/* Handles pending connections and client readiness, waiting for at most timeout ms (-1 for no limit) */
+void poll_broadcast_events(OSMPCNetworkProxy component, int timeout)
+{
+#ifdef __linux__
+    struct epoll_event events[16];
+    int count, i;
+
+    count = epoll_wait(component->broadcast_epoll,events,16,timeout);
+    for (i=0;i<count;i++) {
+        OSMPCNetworkProxyClient* client;
+        if (events[i].data.u32 == 0) {
+            accept_broadcast_clients(component);
+            continue;
+        }
+        client = &component->broadcast_clients[events[i].data.u32-1];
+        if (client->socket == INVALID_SOCKET)
+            continue;
+        if (events[i].events & (EPOLLERR|EPOLLHUP))
+            disconnect_broadcast_client(component,client,"connection error");
+        else {
+            if (events[i].events & (EPOLLIN|EPOLLRDHUP))
+                drain_broadcast_client(component,client);
+            if (events[i].events & EPOLLOUT)
+                flush_broadcast_client(component,client);
+        }
+    }
+#else
+    struct pollfd* fds = component->broadcast_pollfds;
+    OSMPCNetworkProxyClient** clients = component->broadcast_pollclients;
+    int count = 1, i;
+
+    fds[0].fd = component->tcp_proxy_listen_socket;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (i=0;i<component->broadcast_max_clients;i++) {
+        OSMPCNetworkProxyClient* client = &component->broadcast_clients[i];
+        if (client->socket == INVALID_SOCKET)
+            continue;
+        fds[count].fd = client->socket;
+        fds[count].events = POLLIN | (client->queue_count > 0 ? POLLOUT : 0);
+        fds[count].revents = 0;
+        clients[count++] = client;
+    }
+#ifdef _WIN32
+    if (WSAPoll(fds,count,timeout) <= 0)
+#else
+    if (poll(fds,count,timeout) <= 0)
+#endif
+        return;
+    for (i=1;i<count;i++) {
+        if (fds[i].revents & (POLLERR|POLLHUP|POLLNVAL))
+            disconnect_broadcast_client(component,clients[i],"connection error");
+        else {
+            if (fds[i].revents & POLLIN)
+                drain_broadcast_client(component,clients[i]);
+            if ((fds[i].revents & POLLOUT) && clients[i]->socket != INVALID_SOCKET)
+                flush_broadcast_client(component,clients[i]);
+        }
+    }
+    if (fds[0].revents & POLLIN)
+        accept_broadcast_clients(component);
+#endif
+}
+
+int start_broadcast_server(OSMPCNetworkProxy component)
+{
+    int max_clients = component->integer_vars[FMI_INTEGER_MAX_CLIENTS_IDX];
+    int queue_length = component->integer_vars[FMI_INTEGER_CLIENT_QUEUE_LENGTH_IDX] > 0 ? component->integer_vars[FMI_INTEGER_CLIENT_QUEUE_LENGTH_IDX] : FMU_DEFAULT_CLIENT_QUEUE_LENGTH;
+    int i;
+
+    if (!ensure_tcp_proxy_listen(component))
+        return 0;
+    if (!set_socket_blocking(component->tcp_proxy_listen_socket,0) || listen(component->tcp_proxy_listen_socket,SOMAXCONN) != 0) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error listening on socket: %d",WSAGetLastError());
+#else
+        normal_log(component,"NET","Error listening on socket: %d (%s)",errno,strerror(errno));
+#endif
+        close_tcp_proxy_listen(component);
+        return 0;
+    }
+
+    component->broadcast_clients = calloc(max_clients,sizeof(OSMPCNetworkProxyClient));
+#ifndef __linux__
+    component->broadcast_pollfds = calloc(max_clients+1,sizeof(struct pollfd));
+    component->broadcast_pollclients = calloc(max_clients+1,sizeof(OSMPCNetworkProxyClient*));
+#endif
+    if (component->broadcast_clients == NULL) {
+        normal_log(component,"NET","Failed to allocate broadcast clients");
+        return 0;
+    }
+    /* All sockets are invalid before the first allocation can fail, so stop_broadcast_server closes none */
+    for (i=0;i<max_clients;i++)
+        component->broadcast_clients[i].socket = INVALID_SOCKET;
+    component->broadcast_max_clients = max_clients;
+    component->broadcast_queue_length = queue_length;
+    for (i=0;i<max_clients;i++) {
+        component->broadcast_clients[i].queue = calloc(queue_length,sizeof(OSMPCNetworkProxyBroadcastMessage*));
+        if (component->broadcast_clients[i].queue == NULL) {
+            normal_log(component,"NET","Failed to allocate broadcast client queues");
+            return 0;
+        }
+    }
+#ifdef __linux__
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = 0;
+        component->broadcast_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (component->broadcast_epoll < 0 || epoll_ctl(component->broadcast_epoll,EPOLL_CTL_ADD,component->tcp_proxy_listen_socket,&event) != 0) {
+            normal_log(component,"NET","Error setting up epoll: %d (%s)",errno,strerror(errno));
+            return 0;
+        }
+    }
+#else
+    if (component->broadcast_pollfds == NULL || component->broadcast_pollclients == NULL) {
+        normal_log(component,"NET","Failed to allocate broadcast poll set");
+        return 0;
+    }
+#endif
+    component->integer_vars[FMI_INTEGER_CLIENTS_IDX] = 0;
+    normal_log(component,"NET","Serving up to %d clients with queue length %d and backpressure policy %d",max_clients,queue_length,component->integer_vars[FMI_INTEGER_BACKPRESSURE_IDX]);
+    return 1;
+}
+
+void stop_broadcast_server(OSMPCNetworkProxy component)
+{
+    int i;
+
+    if (component->broadcast_clients == NULL)
+        return;
+    for (i=0;i<component->broadcast_max_clients;i++) {
+        if (component->broadcast_clients[i].socket != INVALID_SOCKET)
+            disconnect_broadcast_client(component,&component->broadcast_clients[i],"terminating");
+        free(component->broadcast_clients[i].queue);
+    }
+    free(component->broadcast_clients);
+    component->broadcast_clients = NULL;
+    component->broadcast_max_clients = 0;
+    while (component->broadcast_free != NULL) {
+        OSMPCNetworkProxyBroadcastMessage* message = component->broadcast_free;
+        component->broadcast_free = message->next;
+        free(message);
+    }
+#ifdef __linux__
+    if (component->broadcast_epoll >= 0)
+        close(component->broadcast_epoll);
+    component->broadcast_epoll = -1;
+#else
+    free(component->broadcast_pollfds);
+    free(component->broadcast_pollclients);
+    component->broadcast_pollfds = NULL;
+    component->broadcast_pollclients = NULL;
+#endif
+}
+
+/* Makes room in a full client queue as the backpressure policy demands, returning whether the new message can be queued */
+int apply_backpressure(OSMPCNetworkProxy component, OSMPCNetworkProxyClient* client)
+{
+    int i;
+
+    switch (component->integer_vars[FMI_INTEGER_BACKPRESSURE_IDX]) {
+    case BACKPRESSURE_BLOCK:
+        client->blocked_steps++;
+        while (client->socket != INVALID_SOCKET && client->queue_count == component->broadcast_queue_length) {
+            flush_broadcast_client(component,client);
+            if (client->socket != INVALID_SOCKET && client->queue_count == component->broadcast_queue_length)
+                poll_broadcast_events(component,-1);
+        }
+        return client->socket != INVALID_SOCKET;
+    case BACKPRESSURE_DISCONNECT:
+        disconnect_broadcast_client(component,client,"queue full");
+        return 0;
+    default:
+        client->messages_dropped++;
+        /* A partially sent message has to be completed, so drop the one after it, or the new one if there is none */
+        i = client->queue_offset > 0 ? 1 : 0;
+        if (i >= client->queue_count)
+            return 0;
+        release_broadcast_message(component,client->queue[(client->queue_head+i) % component->broadcast_queue_length]);
+        for (;i<client->queue_count-1;i++)
+            client->queue[(client->queue_head+i) % component->broadcast_queue_length] = client->queue[(client->queue_head+i+1) % component->broadcast_queue_length];
+        client->queue_count--;
+        return 1;
+    }
+}
+
+/* Queues the input for all clients and sends as much as they take, returning whether any client got it */
+int broadcast_input(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
+{
+    OSMPCNetworkProxyBroadcastMessage* message;
+    int queued = 0;
+    int i;
+
+    if (buffersize < 0)
+        buffersize = 0;
+    message = acquire_broadcast_message(component,sizeof(fmi2Integer)+buffersize);
+    if (message == NULL) {
+        normal_log(component,"NET","Failed to allocate broadcast message of size %d",buffersize);
+        return 0;
+    }
+    /* The step holds one reference until all clients have queued the message */
+    message->refs = 1;
+    message->size = sizeof(fmi2Integer)+buffersize;
+    memcpy(message->data,&buffersize,sizeof(fmi2Integer));
+    if (buffersize > 0)
+        memcpy(message->data+sizeof(fmi2Integer),buffer,buffersize);
+
+    poll_broadcast_events(component,0);
+    for (i=0;i<component->broadcast_max_clients;i++) {
+        OSMPCNetworkProxyClient* client = &component->broadcast_clients[i];
+        if (client->socket == INVALID_SOCKET)
+            continue;
+        if (client->queue_count == component->broadcast_queue_length && !apply_backpressure(component,client))
+            continue;
+        message->refs++;
+        client->queue[(client->queue_head+client->queue_count++) % component->broadcast_queue_length] = message;
+        if (client->queue_count > client->max_queued)
+            client->max_queued = client->queue_count;
+        flush_broadcast_client(component,client);
+        queued = 1;
+    }
+    release_broadcast_message(component,message);
+    if (queued)
+        normal_log(component,"NET","Broadcast message with size %d to %d clients.",buffersize,component->integer_vars[FMI_INTEGER_CLIENTS_IDX]);
+    return queued;
+}
+
+#else
+
+int ensure_tcp_proxy_connection(OSMPCNetworkProxy component)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    SOCKET s;
+    int rc;
+    int error=0;
+#ifdef _WIN32
+    int errorsize=sizeof(error);
+#else
+    socklen_t errorsize=sizeof(error);
+#endif
+
+    if (component->tcp_proxy_socket != INVALID_SOCKET)
+        return 1;
+
+    if (component->tcp_proxy_pending_socket == INVALID_SOCKET) {
+        if (!tcp_proxy_retry_due(component))
+            return 0;
+
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_flags = AI_NUMERICHOST;
+        hints.ai_addrlen=0;
+        hints.ai_canonname=0;
+        hints.ai_addr=0;
+        hints.ai_next=0;
+
+        normal_log(component,"NET","Connecting to %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
+        rc=getaddrinfo(component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX],&hints,&result);
+        if (rc!=0 || !result) {
+#ifdef _WIN32
+            normal_log(component,"NET","Error getting destination address: %d",WSAGetLastError());
+#else
+            normal_log(component,"NET","Error getting destination address: %d (%s)",rc,gai_strerror(rc));
+#endif
+            schedule_tcp_proxy_retry(component);
+            return 0;
+        }
+
+        s = socket(result->ai_family,SOCK_STREAM,IPPROTO_TCP);
+        if (s == INVALID_SOCKET || !set_socket_blocking(s,0)) {
+#ifdef _WIN32
+            normal_log(component,"NET","Error setting up Socket: %d",WSAGetLastError());
+            if (s != INVALID_SOCKET)
+                closesocket(s);
+#else
+            normal_log(component,"NET","Error setting up Socket: %d (%s)",errno,strerror(errno));
+            if (s != INVALID_SOCKET)
+                close(s);
+#endif
+            freeaddrinfo(result);
+            schedule_tcp_proxy_retry(component);
+            return 0;
+        }
+
+        configure_tcp_proxy_socket(component,s);
+        rc = connect(s,result->ai_addr,result->ai_addrlen);
+#ifdef _WIN32
+        if (rc != 0 && WSAGetLastError() != WSAEWOULDBLOCK) {
+            normal_log(component,"NET","Error setting up Socket Connection: %d",WSAGetLastError());
+            closesocket(s);
+#else
+        if (rc != 0 && errno != EINPROGRESS) {
+            normal_log(component,"NET","Error setting up Socket Connection: %d (%s)",errno,strerror(errno));
+            close(s);
+#endif
+            freeaddrinfo(result);
+            schedule_tcp_proxy_retry(component);
+            return 0;
+        }
+
+        freeaddrinfo(result);
+        component->tcp_proxy_pending_socket = s;
+    }
+
+    /* The connect is complete once the socket becomes writable, for at most connectTimeout */
+    rc = wait_tcp_proxy_socket(component,component->tcp_proxy_pending_socket,POLLOUT);
+    if (rc == 0)
+        return 0;
+    s = component->tcp_proxy_pending_socket;
+    component->tcp_proxy_pending_socket = INVALID_SOCKET;
+    if (rc < 0 || getsockopt(s,SOL_SOCKET,SO_ERROR,(char*)&error,&errorsize) != 0 || error != 0) {
+#ifdef _WIN32
+        normal_log(component,"NET","Error setting up Socket Connection: %d",error != 0 ? error : WSAGetLastError());
+        closesocket(s);
+#else
+        if (error == 0)
+            error = errno;
+        normal_log(component,"NET","Error setting up Socket Connection: %d (%s)",error,strerror(error));
+        close(s);
+#endif
+        schedule_tcp_proxy_retry(component);
+        return 0;
+    }
+
+    component->tcp_proxy_socket = s;
+    return complete_tcp_proxy_connection(component);
+}
+
+void close_tcp_proxy_connection(OSMPCNetworkProxy component)
+{
+    if (component->tcp_proxy_socket!=INVALID_SOCKET) {
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_socket);
+#else
+        close(component->tcp_proxy_socket);
+#endif
+        component->tcp_proxy_socket=INVALID_SOCKET;
+        component->wire_negotiated=0;
+    }
+    if (component->tcp_proxy_pending_socket!=INVALID_SOCKET) {
+#ifdef _WIN32
+        closesocket(component->tcp_proxy_pending_socket);
+#else
+        close(component->tcp_proxy_pending_socket);
+#endif
+        component->tcp_proxy_pending_socket=INVALID_SOCKET;
+    }
+}
+
+#endif
+
+/*
+ * Receive Buffers
+ *
+ * Received messages are stored in buffers from a small per-instance
+ * pool, which rotate through output and previous output (and pipeline
+ * slots) instead of being allocated and freed for every message.  Pool
+ * buffers only ever grow (geometrically), and are not zero-initialized,
+ * as they are always completely overwritten by the received message.
+ * A hit is a request that was satisfied by a free buffer of sufficient
+ * capacity, all other requests (new or grown buffers) are misses.
+ */
+
+char* acquire_receive_buffer(OSMPCNetworkProxy component, size_t size)
+{
+    OSMPCNetworkProxyBuffer* best = NULL;
+    OSMPCNetworkProxyBuffer* largest = NULL;
+    char* result = NULL;
+    int i;
+
+    osmp_mutex_lock(&component->pool_mutex);
+    for (i=0;i<component->pool_count;i++) {
+        OSMPCNetworkProxyBuffer* buffer = &component->pool_buffers[i];
+        if (buffer->in_use)
+            continue;
+        if (buffer->capacity >= size && (best == NULL || buffer->capacity < best->capacity))
+            best = buffer;
+        if (largest == NULL || buffer->capacity > largest->capacity)
+            largest = buffer;
+    }
+
+    if (best != NULL) {
+        component->pool_hits++;
+    } else {
+        component->pool_misses++;
+        best = largest;
+        if (best == NULL) {
+            OSMPCNetworkProxyBuffer* buffers = realloc(component->pool_buffers,(component->pool_count+1)*sizeof(OSMPCNetworkProxyBuffer));
+            if (buffers != NULL) {
+                component->pool_buffers = buffers;
+                best = &buffers[component->pool_count++];
+                best->ptr = NULL;
+                best->capacity = 0;
+                best->in_use = 0;
+            }
+        }
+        if (best != NULL) {
+            size_t capacity = best->capacity > 0 ? best->capacity : 4096;
+            while (capacity < size)
+                capacity *= 2;
+            free(best->ptr);
+            best->ptr = malloc(capacity);
+            best->capacity = best->ptr != NULL ? capacity : 0;
+        }
+    }
+
+    if (best != NULL && best->ptr != NULL) {
+        best->in_use = 1;
+        result = best->ptr;
+    }
+    osmp_mutex_unlock(&component->pool_mutex);
+    return result;
+}
+
+void release_receive_buffer(OSMPCNetworkProxy component, char* ptr)
+{
+    int i;
+
+    if (ptr == NULL)
+        return;
+    osmp_mutex_lock(&component->pool_mutex);
+    for (i=0;i<component->pool_count;i++)
+        if (component->pool_buffers[i].ptr == ptr)
+            component->pool_buffers[i].in_use = 0;
+    osmp_mutex_unlock(&component->pool_mutex);
+}
+
+void free_receive_buffers(OSMPCNetworkProxy component)
+{
+    int i;
+
+    if (component->pool_hits > 0 || component->pool_misses > 0)
+        normal_log(component,"NET","Receive buffer pool: %lu hits, %lu misses, %d buffers",component->pool_hits,component->pool_misses,component->pool_count);
+    for (i=0;i<component->pool_count;i++)
+        free(component->pool_buffers[i].ptr);
+    free(component->pool_buffers);
+    component->pool_buffers = NULL;
+    component->pool_count = 0;
+    component->pool_hits = 0;
+    component->pool_misses = 0;
+}
+
+/* Receives exactly size bytes, logging failures */
+int recv_tcp_data(OSMPCNetworkProxy component, void* data, fmi2Integer size, const char* what)
+{
+    int recvval=recv(component->tcp_proxy_socket,(char*)data,size,MSG_WAITALL);
+    if (recvval!=size) {
+#ifdef _WIN32
+        normal_log(component,"NET","Failed to recv %s with size %d: %d",what,size,WSAGetLastError());
+#else
+        normal_log(component,"NET","Failed to recv %s with size %d: %d (%s)",what,size,errno,strerror(errno));
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+/* Receives a message into a receive buffer (NULL for empty messages), decompressing it if necessary */
+int recv_tcp_message(OSMPCNetworkProxy component, char** data, fmi2Integer* size)
+{
+    OSMPCNetworkProxyWireHeader header;
+    fmi2Integer frame_size=0;
+    fmi2Integer recv_buffer_size=0;
+    char* recv_buffer_ptr=NULL;
+
+    *data=NULL;
+    *size=0;
+    if (!recv_tcp_data(component,&frame_size,sizeof(frame_size),"message size"))
+        return 0;
+    if (component->wire_negotiated) {
+        if (frame_size < (fmi2Integer)sizeof(header) || !recv_tcp_data(component,&header,sizeof(header),"message header"))
+            return 0;
+        frame_size -= sizeof(header);
+        recv_buffer_size = header.size;
+        if ((header.codec == WIRE_CODEC_NONE && frame_size != recv_buffer_size) || recv_buffer_size < 0) {
+            normal_log(component,"NET","Invalid message header (codec %u, size %d, frame size %d)",header.codec,header.size,frame_size);
+            return 0;
+        }
+    } else {
+        header.codec = WIRE_CODEC_NONE;
+        recv_buffer_size = frame_size;
+    }
+    if (recv_buffer_size == 0) {
+        normal_log(component,"NET","Successfully recv empty tcp message with size %d.",recv_buffer_size);
+        return 1;
+    }
+
+    recv_buffer_ptr = recv_buffer_size > 0 ? acquire_receive_buffer(component,recv_buffer_size) : NULL;
+    if (recv_buffer_ptr == NULL) {
+        normal_log(component,"NET","Failed to allocated recv message buffer of size (%d)",recv_buffer_size);
+        return 0;
+    }
+    if (header.codec == WIRE_CODEC_NONE) {
+        if (!recv_tcp_data(component,recv_buffer_ptr,recv_buffer_size,"message itself")) {
+            release_receive_buffer(component,recv_buffer_ptr);
+            return 0;
+        }
+    } else {
+        double start;
+        if (frame_size <= 0 || !ensure_compress_buffer(component,frame_size) || !recv_tcp_data(component,component->compress_buffer,frame_size,"compressed message")) {
+            release_receive_buffer(component,recv_buffer_ptr);
+            return 0;
+        }
+        start = osmp_time_now();
+        if (!decompress_message(component,header.codec,frame_size,recv_buffer_ptr,recv_buffer_size)) {
+            normal_log(component,"NET","Failed to decompress message with codec %u from size %d to %d",header.codec,frame_size,recv_buffer_size);
+            release_receive_buffer(component,recv_buffer_ptr);
+            return 0;
+        }
+        component->compression_time += osmp_time_now() - start;
+    }
+    normal_log(component,"NET","Successfully recv tcp message with size %d.",recv_buffer_size);
+    *data=recv_buffer_ptr;
+    *size=recv_buffer_size;
+    return 1;
+}
+
+/* Sends the input and/or receives the output of one step, as configured, returning whether output was received */
+int exchange_tcp_messages(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize, int* sent, char** data, fmi2Integer* size)
+{
+    *sent=0;
+    *data=NULL;
+    *size=0;
+    if (component->boolean_vars[FMI_BOOLEAN_SENDER_IDX] && ensure_tcp_proxy_connection(component)) {
+        if (send_tcp_message(component,buffer,buffersize)) {
+            normal_log(component,"NET","Successfully sent tcp message with size %d.",buffersize);
+            *sent=1;
+        } else {
+            close_tcp_proxy_connection(component);
+        }
+    }
+    if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX] && ensure_tcp_proxy_connection(component)) {
+        if (recv_tcp_message(component,data,size))
+            return 1;
+        close_tcp_proxy_connection(component);
+    }
+    return 0;
+}
+
+/* Checks whether the address selects the shared memory transport (shm://name) */
+int is_shm_address(OSMPCNetworkProxy component)
+{
+    return component->string_vars[FMI_STRING_ADDRESS_IDX] != NULL && 0==strncmp(component->string_vars[FMI_STRING_ADDRESS_IDX],"shm://",6);
+}
+
+#ifndef _WIN32
+/*
+ * Shared Memory Proxy Communication
+ *
+ * If the address is of the form shm://name, data is exchanged with a
+ * peer on the same host via the POSIX shared memory object /name,
+ * instead of via TCP.  The listening side creates the segment, the
+ * connecting side attaches to it;  the port is not used.  Each
+ * direction is a ring of records, each holding one message, that the
+ * producer copies the input into, and that the consumer provides as
+ * output in place, without copying.  A record is released when its
+ * output is retired, i.e. two steps later, so that the ring should
+ * have room for at least three messages.  The ring sizes are set by
+ * the creating side via sendBufferSize and receiveBufferSize,
+ * defaulting to FMU_SHM_DEFAULT_RING_SIZE.
+ *
+ * Waiting sides sleep on futexes in the segment (polling on non-Linux
+ * systems), and are only woken if they announced themselves as waiting.
+ * Waits fail once the peer has detached, but not if it died without
+ * detaching.
+ */
+
+#ifndef FMU_SHM_DEFAULT_RING_SIZE
+#define FMU_SHM_DEFAULT_RING_SIZE (64*1024*1024)
+#endif
+
+#ifdef FMU_LISTEN
+#define OSMP_SHM_SIDE 0
+#define OSMP_SHM_SEND_RING 1
+#define OSMP_SHM_RECV_RING 0
+#else
+#define OSMP_SHM_SIDE 1
+#define OSMP_SHM_SEND_RING 0
+#define OSMP_SHM_RECV_RING 1
+#endif
+
+#define OSMP_SHM_ROUND(size,align) (((size)+(align)-1)/(align)*(align))
+
+/* Sleeps until the futex word no longer has the given value, or for at most 100ms */
+void shm_futex_wait(uint32_t* word, uint32_t value)
+{
+#ifdef __linux__
+    struct timespec timeout = { 0, 100000000L };
+    syscall(SYS_futex,word,FUTEX_WAIT,value,&timeout,NULL,0);
+#else
+    struct timespec delay = { 0, 50000L };
+    if (__atomic_load_n(word,__ATOMIC_SEQ_CST) == value)
+        nanosleep(&delay,NULL);
+#endif
+}
+
+/* Bumps the futex word, waking the other side if it is waiting */
+void shm_futex_wake(uint32_t* word, uint32_t* waiters)
+{
+    __atomic_add_fetch(word,1,__ATOMIC_SEQ_CST);
+#ifdef __linux__
+    if (__atomic_load_n(waiters,__ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex,word,FUTEX_WAKE,0x7FFFFFFF,NULL,NULL,0);
+#endif
+}
+
+int shm_peer_detached(OSMPCNetworkProxy component)
+{
+    return __atomic_load_n(&component->shm_segment->peer_state[1-OSMP_SHM_SIDE],__ATOMIC_ACQUIRE) == OSMP_SHM_PEER_DETACHED;
+}
+
+int ensure_shm_proxy_connection(OSMPCNetworkProxy component)
+{
+    char name[256];
+    OSMPCNetworkProxyShmHeader* segment;
+    size_t size;
+    int fd;
+
+    if (component->shm_segment != NULL)
+        return 1;
+
+    snprintf(name,sizeof(name),"/%s",component->string_vars[FMI_STRING_ADDRESS_IDX]+6);
+    name[sizeof(name)-1]='\0';
+
+#ifdef FMU_LISTEN
+    {
+        uint64_t capacities[2];
+        int i;
+
+        capacities[0] = component->integer_vars[FMI_INTEGER_RECV_BUFFER_SIZE_IDX] > 0 ? component->integer_vars[FMI_INTEGER_RECV_BUFFER_SIZE_IDX] : FMU_SHM_DEFAULT_RING_SIZE;
+        capacities[1] = component->integer_vars[FMI_INTEGER_SEND_BUFFER_SIZE_IDX] > 0 ? component->integer_vars[FMI_INTEGER_SEND_BUFFER_SIZE_IDX] : FMU_SHM_DEFAULT_RING_SIZE;
+        capacities[0] = OSMP_SHM_ROUND(capacities[0],4096);
+        capacities[1] = OSMP_SHM_ROUND(capacities[1],4096);
+        size = OSMP_SHM_ROUND(sizeof(OSMPCNetworkProxyShmHeader),4096) + capacities[0] + capacities[1];
+
+        normal_log(component,"NET","Creating shared memory segment %s with ring sizes %llu/%llu",name,(unsigned long long)capacities[0],(unsigned long long)capacities[1]);
+        /* Remove any stale segment left behind by a crashed instance */
+        shm_unlink(name);
+        fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600);
+        if (fd < 0) {
+            normal_log(component,"NET","Error creating shared memory segment %s: %d (%s)",name,errno,strerror(errno));
+            return 0;
+        }
+        if (ftruncate(fd,size) != 0) {
+            normal_log(component,"NET","Error sizing shared memory segment %s: %d (%s)",name,errno,strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return 0;
+        }
+        segment = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        close(fd);
+        if (segment == MAP_FAILED) {
+            normal_log(component,"NET","Error mapping shared memory segment %s: %d (%s)",name,errno,strerror(errno));
+            shm_unlink(name);
+            return 0;
+        }
+
+        /* The segment is zero-filled, only the layout needs to be set up */
+        segment->version = OSMP_SHM_VERSION;
+        for (i=0;i<2;i++) {
+            segment->rings[i].offset = i == 0 ? OSMP_SHM_ROUND(sizeof(OSMPCNetworkProxyShmHeader),4096) : segment->rings[0].offset + capacities[0];
+            segment->rings[i].capacity = capacities[i];
+        }
+        segment->peer_state[OSMP_SHM_SIDE] = OSMP_SHM_PEER_ATTACHED;
+        __atomic_store_n(&segment->magic,OSMP_SHM_MAGIC,__ATOMIC_RELEASE);
+    }
+#else
+    {
+        struct stat info;
+
+        normal_log(component,"NET","Attaching to shared memory segment %s",name);
+        fd = shm_open(name,O_RDWR,0);
+        if (fd < 0) {
+            normal_log(component,"NET","Error opening shared memory segment %s: %d (%s)",name,errno,strerror(errno));
+            return 0;
+        }
+        if (fstat(fd,&info) != 0 || (size_t)info.st_size < sizeof(OSMPCNetworkProxyShmHeader)) {
+            normal_log(component,"NET","Shared memory segment %s is not set up yet",name);
+            close(fd);
+            return 0;
+        }
+        size = info.st_size;
+        segment = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        close(fd);
+        if (segment == MAP_FAILED) {
+            normal_log(component,"NET","Error mapping shared memory segment %s: %d (%s)",name,errno,strerror(errno));
+            return 0;
+        }
+        if (__atomic_load_n(&segment->magic,__ATOMIC_ACQUIRE) != OSMP_SHM_MAGIC || segment->version != OSMP_SHM_VERSION ||
+            segment->rings[1].offset + segment->rings[1].capacity > size) {
+            normal_log(component,"NET","Shared memory segment %s is not set up yet or incompatible",name);
+            munmap(segment,size);
+            return 0;
+        }
+        __atomic_store_n(&segment->peer_state[OSMP_SHM_SIDE],OSMP_SHM_PEER_ATTACHED,__ATOMIC_RELEASE);
+    }
+#endif
+
+    component->shm_segment = segment;
+    component->shm_segment_size = size;
+    component->shm_held = 0;
+    return 1;
+}
+
+/* Detaches from the peer, keeping the mapping, as outputs may still reference it */
+void close_shm_proxy_connection(OSMPCNetworkProxy component)
+{
+    OSMPCNetworkProxyShmHeader* segment = component->shm_segment;
+    int i;
+
+    if (segment == NULL || segment->peer_state[OSMP_SHM_SIDE] == OSMP_SHM_PEER_DETACHED)
+        return;
+
+    __atomic_store_n(&segment->peer_state[OSMP_SHM_SIDE],OSMP_SHM_PEER_DETACHED,__ATOMIC_SEQ_CST);
+    for (i=0;i<2;i++) {
+        shm_futex_wake(&segment->rings[i].data_seq,&segment->rings[i].data_waiters);
+        shm_futex_wake(&segment->rings[i].space_seq,&segment->rings[i].space_waiters);
+    }
+#ifdef FMU_LISTEN
+    {
+        char name[256];
+        snprintf(name,sizeof(name),"/%s",component->string_vars[FMI_STRING_ADDRESS_IDX]+6);
+        name[sizeof(name)-1]='\0';
+        shm_unlink(name);
+    }
+#endif
+}
+
+void unmap_shm_proxy_segment(OSMPCNetworkProxy component)
+{
+    if (component->shm_segment != NULL) {
+        close_shm_proxy_connection(component);
+        munmap(component->shm_segment,component->shm_segment_size);
+        component->shm_segment = NULL;
+        component->shm_segment_size = 0;
+        component->shm_held = 0;
+    }
+}
+
+int is_shm_message(OSMPCNetworkProxy component, const char* ptr)
+{
+    return component->shm_segment != NULL && ptr > (char*)component->shm_segment && ptr < (char*)component->shm_segment + component->shm_segment_size;
+}
+
+/* Releases the ring space up to the end of the given record */
+void release_shm_record(OSMPCNetworkProxy component, const OSMPCNetworkProxyShmRecord* record)
+{
+    OSMPCNetworkProxyShmRing* ring = &component->shm_segment->rings[OSMP_SHM_RECV_RING];
+    if (record->end > ring->tail) {
+        __atomic_store_n(&ring->tail,record->end,__ATOMIC_SEQ_CST);
+        shm_futex_wake(&ring->space_seq,&ring->space_waiters);
+    }
+}
+
+/* Releases a received message once it is no longer referenced as output */
+void release_shm_message(OSMPCNetworkProxy component, const char* ptr)
+{
+    component->shm_held--;
+    release_shm_record(component,(const OSMPCNetworkProxyShmRecord*)ptr - 1);
+}
+
+int send_shm_message(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
+{
+    OSMPCNetworkProxyShmRing* ring = &component->shm_segment->rings[OSMP_SHM_SEND_RING];
+    char* data = (char*)component->shm_segment + ring->offset;
+    uint64_t head = ring->head;
+    uint64_t position = head % ring->capacity;
+    uint64_t needed = OSMP_SHM_ROUND(sizeof(OSMPCNetworkProxyShmRecord)+(buffersize > 0 ? buffersize : 0),OSMP_SHM_ALIGN);
+    uint64_t total = needed;
+    OSMPCNetworkProxyShmRecord* record;
+
+    if (needed > ring->capacity) {
+        normal_log(component,"NET","Message with size %d exceeds shared memory ring size %llu",buffersize,(unsigned long long)ring->capacity);
+        return 0;
+    }
+    /* Records are contiguous, so skip the rest of the ring if the record does not fit */
+    if (needed > ring->capacity - position)
+        total += ring->capacity - position;
+
+    while (ring->capacity - (head - __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE)) < total) {
+        uint32_t seen;
+        if (shm_peer_detached(component)) {
+            normal_log(component,"NET","Failed to send shm message with size %d: Peer detached",buffersize);
+            return 0;
+        }
+        __atomic_add_fetch(&ring->space_waiters,1,__ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&ring->space_seq,__ATOMIC_SEQ_CST);
+        if (ring->capacity - (head - __atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST)) < total)
+            shm_futex_wait(&ring->space_seq,seen);
+        __atomic_sub_fetch(&ring->space_waiters,1,__ATOMIC_SEQ_CST);
+    }
+
+    if (total != needed) {
+        record = (OSMPCNetworkProxyShmRecord*)(data + position);
+        record->size = 0;
+        record->flags = OSMP_SHM_RECORD_WRAP;
+        record->end = head + (total - needed);
+        position = 0;
+    }
+    record = (OSMPCNetworkProxyShmRecord*)(data + position);
+    record->size = buffersize > 0 ? buffersize : 0;
+    record->flags = 0;
+    record->end = head + total;
+    if (buffersize > 0)
+        memcpy(record+1,buffer,buffersize);
+
+    __atomic_store_n(&ring->head,head + total,__ATOMIC_SEQ_CST);
+    shm_futex_wake(&ring->data_seq,&ring->data_waiters);
+    normal_log(component,"NET","Successfully sent shm message with size %d.",buffersize);
+    return 1;
+}
+
+/* Receives a message in place (NULL for empty messages), which stays valid until released */
+int recv_shm_message(OSMPCNetworkProxy component, char** data, fmi2Integer* size)
+{
+    OSMPCNetworkProxyShmRing* ring = &component->shm_segment->rings[OSMP_SHM_RECV_RING];
+    char* base = (char*)component->shm_segment + ring->offset;
+    OSMPCNetworkProxyShmRecord* record;
+
+    *data=NULL;
+    *size=0;
+    for (;;) {
+        while (__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE) == ring->read) {
+            uint32_t seen;
+            if (shm_peer_detached(component)) {
+                normal_log(component,"NET","Failed to recv shm message: Peer detached");
+                return 0;
+            }
+            __atomic_add_fetch(&ring->data_waiters,1,__ATOMIC_SEQ_CST);
+            seen = __atomic_load_n(&ring->data_seq,__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->head,__ATOMIC_SEQ_CST) == ring->read)
+                shm_futex_wait(&ring->data_seq,seen);
+            __atomic_sub_fetch(&ring->data_waiters,1,__ATOMIC_SEQ_CST);
+        }
+        record = (OSMPCNetworkProxyShmRecord*)(base + ring->read % ring->capacity);
+        __atomic_store_n(&ring->read,record->end,__ATOMIC_RELEASE);
+        if (!(record->flags & OSMP_SHM_RECORD_WRAP))
+            break;
+    }
+
+    if (record->size == 0) {
+        /* Nothing references empty messages, so they are released right away unless older messages are still held */
+        if (component->shm_held == 0)
+            release_shm_record(component,record);
+        normal_log(component,"NET","Successfully recv empty shm message.");
+        return 1;
+    }
+    component->shm_held++;
+    *data=(char*)(record+1);
+    *size=(fmi2Integer)record->size;
+    normal_log(component,"NET","Successfully recv shm message with size %d.",*size);
+    return 1;
+}
+
+/* Sends the input and/or receives the output of one step, as configured, returning whether output was received */
+int exchange_shm_messages(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize, int* sent, char** data, fmi2Integer* size)
+{
+    *sent=0;
+    *data=NULL;
+    *size=0;
+    if (!ensure_shm_proxy_connection(component))
+        return 0;
+    if (component->boolean_vars[FMI_BOOLEAN_SENDER_IDX])
+        *sent=send_shm_message(component,buffer,buffersize);
+    return component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX] && recv_shm_message(component,data,size);
+}
+#endif
+
+/*
+ * Data Logging
+ *
+ * With logData set, each input is dumped in one go rather than line by
+ * line:  The whole buffer is hex-encoded into a single text buffer,
+ * sized up front and reused across steps, which is passed to the logger
+ * in one call.  The encoder converts eight bytes at a time, computing
+ * the hex digits of all nibbles of a 64-bit word in parallel.  If
+ * logDataFile is set, the raw inputs are instead appended to that file,
+ * each preceded by its size as a 4 byte integer (as on the wire, and as
+ * in OSI binary trace files).  With logDataSampling set to N > 1, only
+ * every Nth input is dumped, so that logging can stay enabled on long
+ * runs.
+ */
+
+#define HEX_DUMP_INDENT "       "
+#define HEX_DUMP_LINE_LENGTH (7+16*3+1)
+#define HEX_NIBBLES 0x0F0F0F0F0F0F0F0FULL
+#define HEX_ZEROS 0x3030303030303030ULL
+#define HEX_SIXES 0x0606060606060606ULL
+#define HEX_ONES 0x0101010101010101ULL
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HEX_LANE_SHIFT(k) (56-8*(k))
+#else
+#define HEX_LANE_SHIFT(k) (8*(k))
+#endif
+
+/* Writes 8 bytes as " XX" each:  Nibble n becomes '0'+n, plus 7 if n > 9, in all lanes of the word at once */
+void hex_encode_word(const unsigned char* data, char* out)
+{
+    unsigned long long word, hi, lo;
+    int k;
+
+    memcpy(&word,data,sizeof(word));
+    hi = (word >> 4) & HEX_NIBBLES;
+    lo = word & HEX_NIBBLES;
+    hi += HEX_ZEROS + (((hi + HEX_SIXES) >> 4) & HEX_ONES) * 7;
+    lo += HEX_ZEROS + (((lo + HEX_SIXES) >> 4) & HEX_ONES) * 7;
+    for (k = 0; k < 8; k++) {
+        out[3*k] = ' ';
+        out[3*k+1] = (char)(hi >> HEX_LANE_SHIFT(k));
+        out[3*k+2] = (char)(lo >> HEX_LANE_SHIFT(k));
+    }
+}
+
+/* Hex-encodes the buffer into the reused dump buffer, 16 bytes per line, returning NULL on allocation failure */
+const char* format_hex_dump(OSMPCNetworkProxy component, const unsigned char* data, fmi2Integer size)
+{
+    static const char hexmap[]="0123456789ABCDEF";
+    size_t needed = ((size_t)size + 15) / 16 * HEX_DUMP_LINE_LENGTH + 1;
+    fmi2Integer i, j;
+    char* ptr;
+
+    if (needed > component->log_data_capacity) {
+        char* buffer = realloc(component->log_data_buffer,needed);
+        if (buffer == NULL)
+            return NULL;
+        component->log_data_buffer = buffer;
+        component->log_data_capacity = needed;
+    }
+
+    ptr = component->log_data_buffer;
+    for (i = 0; i < size; i += 16) {
+        memcpy(ptr,HEX_DUMP_INDENT,7);
+        ptr += 7;
+        if (size - i >= 16) {
+            hex_encode_word(data+i,ptr);
+            hex_encode_word(data+i+8,ptr+24);
+            ptr += 48;
+        } else {
+            for (j = i; j < size; j++) {
+                *ptr++ = ' ';
+                *ptr++ = hexmap[data[j]>>4];
+                *ptr++ = hexmap[data[j]&0xF];
+            }
+        }
+        *ptr++ = '\n';
+    }
+    if (ptr != component->log_data_buffer)
+        ptr--;
+    *ptr = '\0';
+    return component->log_data_buffer;
+}
+
+/* Opens the binary trace file for logged data, if configured */
+int open_log_data_file(OSMPCNetworkProxy component)
+{
+    const char* path = component->string_vars[FMI_STRING_LOG_DATA_FILE_IDX];
+
+    if (component->log_data_file != NULL || path == NULL || path[0] == '\0')
+        return 1;
+    component->log_data_file = fopen(path,"ab");
+    if (component->log_data_file == NULL) {
+        normal_log(component,"OSMP","Failed to open data log file %s: %d (%s)",path,errno,strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void close_log_data_file(OSMPCNetworkProxy component)
+{
+    if (component->log_data_file != NULL) {
+        fclose(component->log_data_file);
+        component->log_data_file = NULL;
+    }
+}
+
+/* Dumps the input to the trace file or as hex to the log, subject to sampling */
+void log_data(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
+{
+    fmi2Integer sampling = component->integer_vars[FMI_INTEGER_LOG_DATA_SAMPLING_IDX];
+
+    if (sampling > 1 && (component->log_data_count++ % (unsigned long long)sampling) != 0)
+        return;
+
+    if (component->log_data_file != NULL) {
+        if (fwrite(&buffersize,sizeof(buffersize),1,component->log_data_file) != 1 ||
+            fwrite(buffer,1,(size_t)buffersize,component->log_data_file) != (size_t)buffersize) {
+            normal_log(component,"OSMP","Failed to write %d bytes to data log file, closing it",buffersize);
+            close_log_data_file(component);
+        }
+        return;
+    }
+
+    if (log_enabled(component,"OSMP")) {
+        const char* dump = format_hex_dump(component,(const unsigned char*)buffer,buffersize);
+        if (dump != NULL)
+            log_message(component,"OSMP",dump);
+        else
+            normal_log(component,"OSMP","Failed to allocate hex dump of %d bytes",buffersize);
+    }
+}
+
+void free_log_data_state(OSMPCNetworkProxy component)
+{
+    close_log_data_file(component);
+    free(component->log_data_buffer);
+    component->log_data_buffer = NULL;
+    component->log_data_capacity = 0;
+}
+
+/*
+ * Channel Batches
+ *
+ * An FMU built with FMU_CHANNELS set to N > 1 has N inputs and outputs
+ * (OSMPSensorViewIn[1] to [N] and OSMPSensorDataOut[1] to [N]), which
+ * are exchanged as one message per step:  The inputs of all channels
+ * are assembled into one batch, starting with the channel count and
+ * the size of each channel (0 for channels without valid input),
+ * followed by their data in order.  The received batch is kept as one
+ * output buffer, with the outputs of all channels pointing into it, so
+ * any number of sensors costs one message and one round trip per step,
+ * on any transport.  If no channel has valid input, an empty message
+ * is sent, as for a single channel.
+ */
+
+/* Reads the input of a channel, logging it as configured */
+const void* get_channel_input(OSMPCNetworkProxy component, int channel, fmi2Integer* size)
+{
+    const void* buffer = get_binary_variable(component->integer_vars,FMI_INTEGER_CHANNEL_IN_BASELO_IDX(channel),FMI_INTEGER_CHANNEL_IN_BASEHI_IDX(channel),FMI_INTEGER_CHANNEL_IN_SIZE_IDX(channel),size);
+
+    if (buffer != NULL) {
+        normal_log(component,"OSMP","Got %08X %08X LEN %08X, reading from %p (length %i)...",component->integer_vars[FMI_INTEGER_CHANNEL_IN_BASEHI_IDX(channel)],component->integer_vars[FMI_INTEGER_CHANNEL_IN_BASELO_IDX(channel)],*size,buffer,*size);
+        if (component->boolean_vars[FMI_BOOLEAN_LOG_DATA_IDX])
+            log_data(component,buffer,*size);
+        component->boolean_vars[FMI_BOOLEAN_INPUT_VALID_IDX]=fmi2True;
+    } else {
+        *size = 0;
+    }
+    return buffer;
+}
+
+/* Assembles the inputs of all channels into the batch buffer, returning NULL if no channel has valid input */
+const void* get_input_batch(OSMPCNetworkProxy component, fmi2Integer* size)
+{
+    OSMPCNetworkProxyBatchHeader header;
+    const void* inputs[FMU_CHANNELS];
+    size_t total = sizeof(header);
+    char* ptr;
+    int channel;
+
+    *size = 0;
+    header.channels = FMU_CHANNELS;
+    for (channel = 0; channel < FMU_CHANNELS; channel++) {
+        inputs[channel] = get_channel_input(component,channel,&header.sizes[channel]);
+        total += header.sizes[channel];
+    }
+    if (!component->boolean_vars[FMI_BOOLEAN_INPUT_VALID_IDX])
+        return NULL;
+    if (total > 0x7FFFFFFF) {
+        normal_log(component,"OSMP","Batch of %d channels exceeds the maximum message size",FMU_CHANNELS);
+        return NULL;
+    }
+
+    if (total > component->batch_capacity) {
+        char* buffer = realloc(component->batch_buffer,total);
+        if (buffer == NULL) {
+            normal_log(component,"OSMP","Failed to allocate batch buffer of size %d",(int)total);
+            return NULL;
+        }
+        component->batch_buffer = buffer;
+        component->batch_capacity = total;
+    }
+    memcpy(component->batch_buffer,&header,sizeof(header));
+    ptr = component->batch_buffer + sizeof(header);
+    for (channel = 0; channel < FMU_CHANNELS; channel++) {
+        if (header.sizes[channel] > 0)
+            memcpy(ptr,inputs[channel],header.sizes[channel]);
+        ptr += header.sizes[channel];
+    }
+    *size = (fmi2Integer)total;
+    return component->batch_buffer;
+}
+
+void reset_channel_outputs(OSMPCNetworkProxy component)
+{
+    int channel;
+    for (channel = 0; channel < FMU_CHANNELS; channel++)
+        reset_binary_variable(component->integer_vars,FMI_INTEGER_CHANNEL_OUT_BASELO_IDX(channel),FMI_INTEGER_CHANNEL_OUT_BASEHI_IDX(channel),FMI_INTEGER_CHANNEL_OUT_SIZE_IDX(channel));
+}
+
+/* Points the channel outputs into a received batch, returning whether it was well-formed */
+int publish_output_batch(OSMPCNetworkProxy component, char* data, fmi2Integer size)
+{
+    OSMPCNetworkProxyBatchHeader header;
+    fmi2Integer offset = sizeof(header);
+    int channel;
+
+    reset_channel_outputs(component);
+    if (size < (fmi2Integer)sizeof(header)) {
+        normal_log(component,"OSMP","Received batch of size %d is too short for %d channels",size,FMU_CHANNELS);
+        return 0;
+    }
+    memcpy(&header,data,sizeof(header));
+    if (header.channels != FMU_CHANNELS) {
+        normal_log(component,"OSMP","Received batch has %d channels instead of %d",header.channels,FMU_CHANNELS);
+        return 0;
+    }
+    for (channel = 0; channel < FMU_CHANNELS; channel++) {
+        if (header.sizes[channel] < 0 || header.sizes[channel] > size - offset) {
+            normal_log(component,"OSMP","Received batch of size %d has invalid size %d for channel %d",size,header.sizes[channel],channel+1);
+            reset_channel_outputs(component);
+            return 0;
+        }
+        if (header.sizes[channel] > 0)
+            set_binary_variable(component->integer_vars,FMI_INTEGER_CHANNEL_OUT_BASELO_IDX(channel),FMI_INTEGER_CHANNEL_OUT_BASEHI_IDX(channel),FMI_INTEGER_CHANNEL_OUT_SIZE_IDX(channel),data+offset,header.sizes[channel]);
+        offset += header.sizes[channel];
+    }
+    return 1;
+}
+
+/*
+ * Output Buffers
+ */
+
+/* Releases an output buffer back to the pool or, if received in place, the shared memory ring */
+void release_output_buffer(OSMPCNetworkProxy component, char* ptr)
+{
+#ifndef _WIN32
+    if (is_shm_message(component,ptr)) {
+        release_shm_message(component,ptr);
+        return;
+    }
+#endif
+    release_receive_buffer(component,ptr);
+}
+
+/* Retires the current output buffer, which stays valid for one more step */
+void switch_output_buffers(OSMPCNetworkProxy component)
+{
+    if (component->prev_output_buffer_ptr != NULL) {
+        release_output_buffer(component,component->prev_output_buffer_ptr);
+        component->prev_output_buffer_ptr=NULL;
+        component->prev_output_buffer_size=0;
+    }
+    component->prev_output_buffer_ptr = component->output_buffer_ptr;
+    component->prev_output_buffer_size = component->output_buffer_size;
+    component->output_buffer_ptr = NULL;
+    component->output_buffer_size = 0;
+    reset_channel_outputs(component);
+}
+
+/* Provides a received message as output, taking ownership of its buffer */
+void publish_output_buffer(OSMPCNetworkProxy component, char* data, fmi2Integer size)
+{
+    component->boolean_vars[FMI_BOOLEAN_OUTPUT_RECEIVED_IDX] = fmi2True;
+    component->output_buffer_ptr = data;
+    component->output_buffer_size = size;
+    if (data != NULL && FMU_CHANNELS > 1) {
+        component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = publish_output_batch(component,data,size) ? fmi2True : fmi2False;
+    } else if (data != NULL) {
+        set_binary_variable(component->integer_vars,FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX,FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX,FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX,data,size);
+        component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2True;
+    } else {
+        reset_channel_outputs(component);
+        component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2False;
+    }
+}
+
+#ifdef FMU_ZEROMQ
+/*
+ * ZeroMQ Proxy Communication
+ *
+ * If the zmq variable is set, data is exchanged as ZeroMQ messages
+ * instead of size-prefixed TCP streams.  By default the exchange is
+ * in lockstep via a REQ (connecting side) / REP (listening side)
+ * socket pair.  If pubsub is also set, senders publish via a binding
+ * PUB socket and receivers subscribe via connecting SUB sockets, so
+ * that one producer can feed any number of consumers.
+ *
+ * The address is either a complete ZeroMQ endpoint (e.g. inproc://x
+ * or ipc:///tmp/x), or a host that is combined with the port into a
+ * tcp:// endpoint.  All instances of the FMU share one ZeroMQ context,
+ * so that instances can be connected via inproc endpoints.
+ *
+ * Input data is sent without copying:  The message references the
+ * OSMP input buffer directly, and since that buffer is only valid
+ * during the step, the step waits until ZeroMQ has released it.
+ */
+
+#ifndef FMU_ZMQ_RELEASE_TIMEOUT
+#define FMU_ZMQ_RELEASE_TIMEOUT 1000
+#endif
+
+static void* zmq_shared_context = NULL;
+static long zmq_shared_context_users = 0;
+static volatile long zmq_shared_context_lock = 0;
+
+void* acquire_zmq_context()
+{
+    void* context;
+    while (!osmp_atomic_cas(&zmq_shared_context_lock,0,1))
+        ;
+    if (zmq_shared_context_users++ == 0)
+        zmq_shared_context = zmq_ctx_new();
+    context = zmq_shared_context;
+    osmp_atomic_store(&zmq_shared_context_lock,0);
+    return context;
+}
+
+void release_zmq_context()
+{
+    while (!osmp_atomic_cas(&zmq_shared_context_lock,0,1))
+        ;
+    if (zmq_shared_context_users > 0 && --zmq_shared_context_users == 0) {
+        zmq_ctx_term(zmq_shared_context);
+        zmq_shared_context = NULL;
+    }
+    osmp_atomic_store(&zmq_shared_context_lock,0);
+}
+
+void zmq_release_input(void* data, void* hint)
+{
+    osmp_atomic_store((volatile long*)hint,0);
+}
+
+int ensure_zmq_proxy_connection(OSMPCNetworkProxy component)
+{
+    char endpoint[1024];
+    void* context;
+    int type;
+    int linger = 0;
     int rc;
 
-    if (component->tcp_proxy_listen_socket != INVALID_SOCKET)
+    if (component->zmq_proxy_socket != NULL)
         return 1;
 
-    memset(&hints,0,sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_NUMERICHOST|AI_PASSIVE;
-    hints.ai_addrlen=0;
-    hints.ai_canonname=0;
-    hints.ai_addr=0;
-    hints.ai_next=0;
-
-    normal_log(component,"NET","Listening on %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
-    rc=getaddrinfo(component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX],&hints,&result);
-    if (rc!=0 || !result) {
+    if (strstr(component->string_vars[FMI_STRING_ADDRESS_IDX],"://") != NULL)
+        strncpy(endpoint,component->string_vars[FMI_STRING_ADDRESS_IDX],sizeof(endpoint)-1);
+    else
 #ifdef _WIN32
-        normal_log(component,"NET","Error getting listening address: %d",WSAGetLastError());
+        _snprintf_s(endpoint,sizeof(endpoint),_TRUNCATE,"tcp://%s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
 #else
-        normal_log(component,"NET","Error getting listening address: %d (%s)",rc,gai_strerror(rc));
+        snprintf(endpoint,sizeof(endpoint),"tcp://%s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
 #endif
-        return 0;
-    }
+    endpoint[sizeof(endpoint)-1]='\0';
 
-    component->tcp_proxy_listen_socket = socket(result->ai_family,SOCK_STREAM,IPPROTO_TCP);
-    if (component->tcp_proxy_listen_socket == INVALID_SOCKET) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error setting up Socket: %d",WSAGetLastError());
+    if (component->boolean_vars[FMI_BOOLEAN_PUBSUB_IDX])
+        type = component->boolean_vars[FMI_BOOLEAN_SENDER_IDX] ? ZMQ_PUB : ZMQ_SUB;
+    else
+#ifdef FMU_LISTEN
+        type = ZMQ_REP;
 #else
-        normal_log(component,"NET","Error setting up Socket: %d (%s)",errno,strerror(errno));
+        type = ZMQ_REQ;
 #endif
-        freeaddrinfo(result);
+
+    context = acquire_zmq_context();
+    component->zmq_proxy_socket = context != NULL ? zmq_socket(context,type) : NULL;
+    if (component->zmq_proxy_socket == NULL) {
+        normal_log(component,"NET","Error setting up ZeroMQ Socket: %d (%s)",zmq_errno(),zmq_strerror(zmq_errno()));
+        release_zmq_context();
         return 0;
     }
 
-    rc = bind(component->tcp_proxy_listen_socket,result->ai_addr,result->ai_addrlen);
-
+    zmq_setsockopt(component->zmq_proxy_socket,ZMQ_LINGER,&linger,sizeof(linger));
+    if (component->integer_vars[FMI_INTEGER_SEND_BUFFER_SIZE_IDX] > 0)
+        zmq_setsockopt(component->zmq_proxy_socket,ZMQ_SNDBUF,&component->integer_vars[FMI_INTEGER_SEND_BUFFER_SIZE_IDX],sizeof(int));
+    if (component->integer_vars[FMI_INTEGER_RECV_BUFFER_SIZE_IDX] > 0)
+        zmq_setsockopt(component->zmq_proxy_socket,ZMQ_RCVBUF,&component->integer_vars[FMI_INTEGER_RECV_BUFFER_SIZE_IDX],sizeof(int));
+    if (type == ZMQ_SUB)
+        zmq_setsockopt(component->zmq_proxy_socket,ZMQ_SUBSCRIBE,"",0);
+
+    if (type == ZMQ_PUB || type == ZMQ_REP) {
+        normal_log(component,"NET","Binding to %s",endpoint);
+        rc = zmq_bind(component->zmq_proxy_socket,endpoint);
+    } else {
+        normal_log(component,"NET","Connecting to %s",endpoint);
+        rc = zmq_connect(component->zmq_proxy_socket,endpoint);
+    }
     if (rc != 0) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error setting up Socket Bind: %d",WSAGetLastError());
-#else
-        normal_log(component,"NET","Error setting up Socket Bind: %d (%s)",errno,strerror(errno));
-#endif
-#ifdef _WIN32
-        closesocket(component->tcp_proxy_listen_socket);
-#else
-        close(component->tcp_proxy_listen_socket);
-#endif
-        component->tcp_proxy_listen_socket=INVALID_SOCKET;
-        freeaddrinfo(result);
+        normal_log(component,"NET","Error setting up ZeroMQ Connection: %d (%s)",zmq_errno(),zmq_strerror(zmq_errno()));
+        zmq_close(component->zmq_proxy_socket);
+        component->zmq_proxy_socket=NULL;
+        release_zmq_context();
         return 0;
     }
 
-    freeaddrinfo(result);
     return 1;
 }
 
-int ensure_tcp_proxy_connection(OSMPCNetworkProxy component)
+void close_zmq_proxy_connection(OSMPCNetworkProxy component)
 {
-    int rc;
+    if (component->zmq_proxy_socket!=NULL) {
+        zmq_close(component->zmq_proxy_socket);
+        component->zmq_proxy_socket=NULL;
+        release_zmq_context();
+    }
+}
 
-    if (component->tcp_proxy_socket != INVALID_SOCKET)
-        return 1;
+/* Waits until ZeroMQ no longer references the input buffer, dropping the connection after a timeout */
+void wait_for_zmq_input_release(OSMPCNetworkProxy component)
+{
+    int waited = 0;
+    while (osmp_atomic_load(&component->zmq_input_in_flight)) {
+        if (waited++ == FMU_ZMQ_RELEASE_TIMEOUT && component->zmq_proxy_socket != NULL) {
+            normal_log(component,"NET","Input still queued after %d ms, dropping ZeroMQ connection.",FMU_ZMQ_RELEASE_TIMEOUT);
+            close_zmq_proxy_connection(component);
+        }
+        /* Polling no items just sleeps for the given milliseconds */
+        zmq_poll(NULL,0,1);
+    }
+}
 
-    if (!ensure_tcp_proxy_listen(component))
-        return 0;
+int send_zmq_message(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
+{
+    zmq_msg_t message;
+    int rc;
 
-    normal_log(component,"NET","Listening on %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
-    rc=listen(component->tcp_proxy_listen_socket,SOMAXCONN);
-    if (rc!=0) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error listening on socket: %d",WSAGetLastError());
-        closesocket(component->tcp_proxy_listen_socket);
-#else
-        normal_log(component,"NET","Error listening on socket: %d (%s)",rc,gai_strerror(rc));
-        close(component->tcp_proxy_listen_socket);
-#endif
-        component->tcp_proxy_listen_socket=INVALID_SOCKET;
+    if (buffersize > 0) {
+        osmp_atomic_store(&component->zmq_input_in_flight,1);
+        rc = zmq_msg_init_data(&message,(void*)buffer,buffersize,zmq_release_input,(void*)&component->zmq_input_in_flight);
+        if (rc != 0)
+            osmp_atomic_store(&component->zmq_input_in_flight,0);
+    } else {
+        rc = zmq_msg_init(&message);
+    }
+    if (rc != 0) {
+        normal_log(component,"NET","Failed to set up ZeroMQ message with size %d: %d (%s)",buffersize,zmq_errno(),zmq_strerror(zmq_errno()));
         return 0;
     }
 
-    component->tcp_proxy_socket = accept(component->tcp_proxy_listen_socket,NULL,NULL);
-    if (component->tcp_proxy_socket == INVALID_SOCKET) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error accepting on Socket: %d",WSAGetLastError());
-        closesocket(component->tcp_proxy_listen_socket);
-#else
-        normal_log(component,"NET","Error accpeting on Socket: %d (%s)",errno,strerror(errno));
-        close(component->tcp_proxy_listen_socket);
-#endif
-        component->tcp_proxy_listen_socket=INVALID_SOCKET;
+    if (zmq_msg_send(&message,component->zmq_proxy_socket,0) < 0) {
+        normal_log(component,"NET","Failed to send ZeroMQ message with size %d: %d (%s)",buffersize,zmq_errno(),zmq_strerror(zmq_errno()));
+        zmq_msg_close(&message);
+        close_zmq_proxy_connection(component);
         return 0;
     }
 
+    normal_log(component,"NET","Successfully sent ZeroMQ message with size %d.",buffersize);
     return 1;
 }
 
-void close_tcp_proxy_connection(OSMPCNetworkProxy component)
+/* Receives a message, and if store is set provides a copy of it as output */
+int recv_zmq_message(OSMPCNetworkProxy component, int store)
 {
-    if (component->tcp_proxy_socket!=INVALID_SOCKET) {
-#ifdef _WIN32
-        closesocket(component->tcp_proxy_socket);
-#else
-        close(component->tcp_proxy_socket);
-#endif
-        component->tcp_proxy_socket=INVALID_SOCKET;
+    zmq_msg_t message;
+    int size;
+
+    zmq_msg_init(&message);
+    if (zmq_msg_recv(&message,component->zmq_proxy_socket,0) < 0) {
+        normal_log(component,"NET","Failed to recv ZeroMQ message: %d (%s)",zmq_errno(),zmq_strerror(zmq_errno()));
+        zmq_msg_close(&message);
+        close_zmq_proxy_connection(component);
+        return 0;
+    }
+
+    size = (int)zmq_msg_size(&message);
+    normal_log(component,"NET","Successfully recv ZeroMQ message with size %d.",size);
+    if (store) {
+        char* recv_buffer_ptr = size > 0 ? acquire_receive_buffer(component,size) : NULL;
+        if (size > 0 && recv_buffer_ptr == NULL) {
+            normal_log(component,"NET","Failed to allocated recv message buffer of size (%d)",size);
+            component->boolean_vars[FMI_BOOLEAN_OUTPUT_RECEIVED_IDX] = fmi2False;
+            component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2False;
+        } else {
+            if (size > 0)
+                memcpy(recv_buffer_ptr,zmq_msg_data(&message),size);
+            publish_output_buffer(component,recv_buffer_ptr,size);
+        }
     }
+    zmq_msg_close(&message);
+    return 1;
 }
 
-void close_tcp_proxy_listen(OSMPCNetworkProxy component)
+void exchange_zmq_messages(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize)
 {
-    if (component->tcp_proxy_listen_socket!=INVALID_SOCKET) {
-#ifdef _WIN32
-        closesocket(component->tcp_proxy_listen_socket);
+    int send = component->boolean_vars[FMI_BOOLEAN_SENDER_IDX];
+    int receive = component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX];
+
+    if (!ensure_zmq_proxy_connection(component))
+        return;
+
+    if (component->boolean_vars[FMI_BOOLEAN_PUBSUB_IDX]) {
+        if (send) {
+            if (send_zmq_message(component,buffer,buffersize))
+                component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
+        } else {
+            recv_zmq_message(component,receive);
+        }
+    } else {
+        /* REQ/REP strictly alternate, so messages are exchanged even if not sending or receiving */
+#ifdef FMU_LISTEN
+        if (recv_zmq_message(component,receive) && send_zmq_message(component,send ? buffer : NULL,send ? buffersize : 0))
+            component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=send ? fmi2True : fmi2False;
 #else
-        close(component->tcp_proxy_listen_socket);
+        if (send_zmq_message(component,send ? buffer : NULL,send ? buffersize : 0)) {
+            component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=send ? fmi2True : fmi2False;
+            recv_zmq_message(component,receive);
+        }
 #endif
-        component->tcp_proxy_listen_socket=INVALID_SOCKET;
     }
+
+    wait_for_zmq_input_release(component);
 }
+#endif
 
-#else
+/*
+ * Pipelined Operation
+ *
+ * With pipelineDepth set to N > 0, messages are exchanged over TCP by
+ * a background I/O thread:  Each step queues a copy of its input and
+ * returns the output received for the input of the step N steps
+ * earlier, so that the network round trip and the remote computation
+ * overlap with local computation.  The peer sees the same sequence of
+ * messages as in lockstep operation.  The output.latency variable gives
+ * the simulation time by which the output lags behind the input, and
+ * input.sent reports on the input of that earlier step.
+ *
+ * The queue holds N+1 slots, which are submitted by doCalc, completed
+ * by the I/O thread and then collected by doCalc, in this order.
+ */
 
-int ensure_tcp_proxy_connection(OSMPCNetworkProxy component)
+/* Logs the messages kept with a slot by the I/O thread, on the calling thread */
+void log_deferred_messages(OSMPCNetworkProxy component, OSMPCNetworkProxyPipelineSlot* slot)
 {
-    struct addrinfo hints;
-    struct addrinfo *result;
-    int rc;
-
-    if (component->tcp_proxy_socket != INVALID_SOCKET)
-        return 1;
+    size_t offset = 0;
+    while (offset < slot->log_size) {
+        const char* category = slot->log_ptr+offset;
+        const char* message = category+strlen(category)+1;
+        log_message(component,category,message);
+        offset = (size_t)(message-slot->log_ptr)+strlen(message)+1;
+    }
+    slot->log_size = 0;
+}
 
-    memset(&hints,0,sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_NUMERICHOST;
-    hints.ai_addrlen=0;
-    hints.ai_canonname=0;
-    hints.ai_addr=0;
-    hints.ai_next=0;
+OSMP_THREAD_FUNCTION(pipeline_thread)
+{
+    OSMPCNetworkProxy component = (OSMPCNetworkProxy)arg;
+    OSMPCNetworkProxyPipelineSlot* slot;
+
+    osmp_mutex_lock(&component->pipeline_mutex);
+    for (;;) {
+        while (component->pipeline_completed == component->pipeline_submitted && !component->pipeline_stop)
+            osmp_cond_wait(&component->pipeline_changed,&component->pipeline_mutex);
+        if (component->pipeline_completed == component->pipeline_submitted)
+            break;
+        slot = &component->pipeline_slots[component->pipeline_completed % (component->pipeline_depth+1)];
+        osmp_mutex_unlock(&component->pipeline_mutex);
+
+        deferred_log_slot = slot;
+        slot->received = exchange_tcp_messages(component,slot->input_ptr,slot->input_size,&slot->sent,&slot->output_ptr,&slot->output_size);
+        deferred_log_slot = NULL;
+
+        osmp_mutex_lock(&component->pipeline_mutex);
+        /* The counters are only updated by this thread while it runs, doCalc reads the copies */
+        slot->compression_bytes_in = component->compression_bytes_in;
+        slot->compression_bytes_out = component->compression_bytes_out;
+        slot->compression_time = component->compression_time;
+        component->pipeline_completed++;
+        osmp_cond_broadcast(&component->pipeline_changed);
+    }
+    osmp_mutex_unlock(&component->pipeline_mutex);
+    OSMP_THREAD_RETURN;
+}
 
-    normal_log(component,"NET","Connecting to %s:%s",component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX]);
-    rc=getaddrinfo(component->string_vars[FMI_STRING_ADDRESS_IDX],component->string_vars[FMI_STRING_PORT_IDX],&hints,&result);
-    if (rc!=0 || !result) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error getting destination address: %d",WSAGetLastError());
-#else
-        normal_log(component,"NET","Error getting destination address: %d (%s)",rc,gai_strerror(rc));
-#endif
+int start_pipeline(OSMPCNetworkProxy component, int depth)
+{
+    component->pipeline_slots = calloc(depth+1,sizeof(OSMPCNetworkProxyPipelineSlot));
+    if (component->pipeline_slots == NULL) {
+        normal_log(component,"NET","Failed to allocate pipeline of depth %d",depth);
         return 0;
     }
-
-    component->tcp_proxy_socket = socket(result->ai_family,SOCK_STREAM,IPPROTO_TCP);
-    if (component->tcp_proxy_socket == INVALID_SOCKET) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error setting up Socket: %d",WSAGetLastError());
-#else
-        normal_log(component,"NET","Error setting up Socket: %d (%s)",errno,strerror(errno));
-#endif
-        freeaddrinfo(result);
+    component->pipeline_depth = depth;
+    component->pipeline_submitted = 0;
+    component->pipeline_completed = 0;
+    component->pipeline_collected = 0;
+    component->pipeline_stop = 0;
+    osmp_mutex_init(&component->pipeline_mutex);
+    osmp_cond_init(&component->pipeline_changed);
+    if (!osmp_thread_start(&component->pipeline_thread,pipeline_thread,component)) {
+        normal_log(component,"NET","Failed to start pipeline I/O thread");
+        osmp_cond_destroy(&component->pipeline_changed);
+        osmp_mutex_destroy(&component->pipeline_mutex);
+        free(component->pipeline_slots);
+        component->pipeline_slots = NULL;
+        component->pipeline_depth = 0;
         return 0;
     }
+    normal_log(component,"NET","Started pipelined operation with depth %d",depth);
+    return 1;
+}
 
-    rc = connect(component->tcp_proxy_socket,result->ai_addr,result->ai_addrlen);
+/* Stops the I/O thread after it has exchanged all queued messages */
+void stop_pipeline(OSMPCNetworkProxy component)
+{
+    int i;
 
-    if (rc != 0) {
-#ifdef _WIN32
-        normal_log(component,"NET","Error setting up Socket Connection: %d",WSAGetLastError());
-#else
-        normal_log(component,"NET","Error setting up Socket Connection: %d (%s)",errno,strerror(errno));
-#endif
-#ifdef _WIN32
-        closesocket(component->tcp_proxy_socket);
-#else
-        close(component->tcp_proxy_socket);
-#endif
-        component->tcp_proxy_socket=INVALID_SOCKET;
-        freeaddrinfo(result);
-        return 0;
+    if (component->pipeline_depth == 0)
+        return;
+
+    osmp_mutex_lock(&component->pipeline_mutex);
+    component->pipeline_stop = 1;
+    osmp_cond_broadcast(&component->pipeline_changed);
+    osmp_mutex_unlock(&component->pipeline_mutex);
+    osmp_thread_join(component->pipeline_thread);
+    osmp_cond_destroy(&component->pipeline_changed);
+    osmp_mutex_destroy(&component->pipeline_mutex);
+
+    /* Slots exchanged but never collected still hold messages of the I/O thread */
+    for (; component->pipeline_collected != component->pipeline_completed; component->pipeline_collected++)
+        log_deferred_messages(component,&component->pipeline_slots[component->pipeline_collected % (component->pipeline_depth+1)]);
+    for (i=0;i<=component->pipeline_depth;i++) {
+        free(component->pipeline_slots[i].input_ptr);
+        free(component->pipeline_slots[i].log_ptr);
+        release_receive_buffer(component,component->pipeline_slots[i].output_ptr);
     }
-
-    freeaddrinfo(result);
-    return 1;
+    free(component->pipeline_slots);
+    component->pipeline_slots = NULL;
+    component->pipeline_depth = 0;
 }
 
-void close_tcp_proxy_connection(OSMPCNetworkProxy component)
+void exchange_pipelined(OSMPCNetworkProxy component, const void* buffer, fmi2Integer buffersize, double time)
 {
-    if (component->tcp_proxy_socket!=INVALID_SOCKET) {
-#ifdef _WIN32
-        closesocket(component->tcp_proxy_socket);
-#else
-        close(component->tcp_proxy_socket);
-#endif
-        component->tcp_proxy_socket=INVALID_SOCKET;
+    unsigned long slots = component->pipeline_depth+1;
+    OSMPCNetworkProxyPipelineSlot* slot = &component->pipeline_slots[component->pipeline_submitted % slots];
+
+    /* The slot is free:  At most depth slots are outstanding between steps */
+    if (buffersize > 0 && (size_t)buffersize > slot->input_capacity) {
+        free(slot->input_ptr);
+        slot->input_ptr = malloc(buffersize);
+        slot->input_capacity = slot->input_ptr != NULL ? buffersize : 0;
+    }
+    if (buffersize > 0 && slot->input_ptr == NULL) {
+        normal_log(component,"NET","Failed to allocate pipeline input buffer of size %d, sending empty message",buffersize);
+        buffersize = 0;
+    }
+    if (buffersize > 0)
+        memcpy(slot->input_ptr,buffer,buffersize);
+    slot->input_size = buffersize;
+    slot->time = time;
+
+    osmp_mutex_lock(&component->pipeline_mutex);
+    component->pipeline_submitted++;
+    osmp_cond_broadcast(&component->pipeline_changed);
+    if (component->pipeline_submitted - component->pipeline_collected <= (unsigned long)component->pipeline_depth) {
+        osmp_mutex_unlock(&component->pipeline_mutex);
+        /* Pipeline is still filling up */
+        if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX]) {
+            switch_output_buffers(component);
+            component->boolean_vars[FMI_BOOLEAN_OUTPUT_RECEIVED_IDX] = fmi2False;
+            component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2False;
+        }
+        return;
+    }
+    while (component->pipeline_completed == component->pipeline_collected)
+        osmp_cond_wait(&component->pipeline_changed,&component->pipeline_mutex);
+    slot = &component->pipeline_slots[component->pipeline_collected++ % slots];
+    osmp_mutex_unlock(&component->pipeline_mutex);
+
+    log_deferred_messages(component,slot);
+
+    component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX] = slot->sent ? fmi2True : fmi2False;
+    component->real_vars[FMI_REAL_OUTPUT_LATENCY_IDX] = time - slot->time;
+    if (wire_format_enabled(component))
+        update_compression_outputs(component,slot->compression_bytes_in,slot->compression_bytes_out,slot->compression_time);
+    if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX]) {
+        switch_output_buffers(component);
+        if (slot->received)
+            publish_output_buffer(component,slot->output_ptr,slot->output_size);
+        else
+            component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2False;
+        slot->output_ptr = NULL;
+        slot->output_size = 0;
     }
 }
 
+void free_compression_state(OSMPCNetworkProxy component)
+{
+    if (component->compression_bytes_out > 0 || component->compression_time > 0.0)
+        normal_log(component,"NET","Compression: %llu bytes sent as %llu bytes, %g s compressing and decompressing",component->compression_bytes_in,component->compression_bytes_out,component->compression_time);
+    free(component->compress_buffer);
+    component->compress_buffer = NULL;
+    component->compress_capacity = 0;
+    component->compression_bytes_in = 0;
+    component->compression_bytes_out = 0;
+    component->compression_time = 0.0;
+#ifdef FMU_ZSTD
+    ZSTD_freeCCtx(component->zstd_cctx);
+    ZSTD_freeDCtx(component->zstd_dctx);
+    component->zstd_cctx = NULL;
+    component->zstd_dctx = NULL;
 #endif
+}
+
 /*
  * Actual Core Content
  */
@@ -333,6 +2422,10 @@ fmi2Status doInit(OSMPCNetworkProxy component)
     /* Strings */
     component->string_vars[FMI_STRING_ADDRESS_IDX]=strdup(FMU_DEFAULT_ADDRESS);
     component->string_vars[FMI_STRING_PORT_IDX]=strdup(FMU_DEFAULT_PORT);
+    component->string_vars[FMI_STRING_COMPRESSION_IDX]=strdup("");
+    component->string_vars[FMI_STRING_LOG_DATA_FILE_IDX]=strdup("");
+    component->real_vars[FMI_REAL_COMPRESSION_RATIO_IDX]=1.0;
+    component->integer_vars[FMI_INTEGER_CONNECT_TIMEOUT_IDX]=-1;
 
     return fmi2OK;
 }
@@ -351,143 +2444,140 @@ fmi2Status doEnterInitializationMode(OSMPCNetworkProxy component)
 
 fmi2Status doExitInitializationMode(OSMPCNetworkProxy component)
 {
+    if (component->boolean_vars[FMI_BOOLEAN_LOG_DATA_IDX] && !open_log_data_file(component))
+        return fmi2Error;
+
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && wire_format_enabled(component)) {
+        if (configured_wire_codec(component) < 0) {
+            normal_log(component,"NET","Compression codec %s is unknown or not supported by this FMU.",component->string_vars[FMI_STRING_COMPRESSION_IDX]);
+            return fmi2Error;
+        }
+        if (component->boolean_vars[FMI_BOOLEAN_ZMQ_IDX] || is_shm_address(component) || component->integer_vars[FMI_INTEGER_MAX_CLIENTS_IDX] > 0) {
+            normal_log(component,"NET","Compression is only supported for TCP connections with a single peer.");
+            return fmi2Error;
+        }
+        component->compression_threshold = component->integer_vars[FMI_INTEGER_COMPRESSION_THRESHOLD_IDX] > 0 ? component->integer_vars[FMI_INTEGER_COMPRESSION_THRESHOLD_IDX] : FMU_DEFAULT_COMPRESSION_THRESHOLD;
+    }
+
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && is_shm_address(component)) {
+#ifndef _WIN32
+        if (component->boolean_vars[FMI_BOOLEAN_ZMQ_IDX] || component->integer_vars[FMI_INTEGER_PIPELINE_DEPTH_IDX] > 0) {
+            normal_log(component,"NET","Shared memory transport supports neither ZeroMQ nor pipelined operation.");
+            return fmi2Error;
+        }
 #ifdef FMU_LISTEN
-    if (!ensure_tcp_proxy_listen(component))
+        return ensure_shm_proxy_connection(component) ? fmi2OK : fmi2Error;
+#else
+        return fmi2OK;
+#endif
+#else
+        normal_log(component,"NET","Shared memory transport is not supported on this platform.");
+        return fmi2Error;
+#endif
+    }
+
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->boolean_vars[FMI_BOOLEAN_ZMQ_IDX]) {
+#ifdef FMU_ZEROMQ
+        if (component->integer_vars[FMI_INTEGER_PIPELINE_DEPTH_IDX] > 0) {
+            normal_log(component,"NET","Pipelined operation is only supported for TCP, not ZeroMQ.");
+            return fmi2Error;
+        }
+        if (component->boolean_vars[FMI_BOOLEAN_PUBSUB_IDX] && component->boolean_vars[FMI_BOOLEAN_SENDER_IDX] && component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX]) {
+            normal_log(component,"NET","PUB/SUB instances can either send or receive, not both.");
+            return fmi2Error;
+        }
+        return ensure_zmq_proxy_connection(component) ? fmi2OK : fmi2Error;
+#else
+        normal_log(component,"NET","ZeroMQ transport requested, but FMU was built without ZeroMQ support.");
         return fmi2Error;
-    else
 #endif
+    }
+
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->integer_vars[FMI_INTEGER_MAX_CLIENTS_IDX] > 0) {
+#ifdef FMU_LISTEN
+        if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX] || component->integer_vars[FMI_INTEGER_PIPELINE_DEPTH_IDX] > 0) {
+            normal_log(component,"NET","Serving several clients only supports sending, without pipelined operation.");
+            return fmi2Error;
+        }
+        if (component->broadcast_clients == NULL && !start_broadcast_server(component)) {
+            stop_broadcast_server(component);
+            return fmi2Error;
+        }
         return fmi2OK;
+#else
+        normal_log(component,"NET","Serving several clients requires an FMU built with FMU_LISTEN.");
+        return fmi2Error;
+#endif
+    }
+
+#ifdef FMU_LISTEN
+    if (!ensure_tcp_proxy_listen(component))
+        return fmi2Error;
+#endif
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->integer_vars[FMI_INTEGER_PIPELINE_DEPTH_IDX] > 0 && component->pipeline_depth == 0)
+        if (!start_pipeline(component,component->integer_vars[FMI_INTEGER_PIPELINE_DEPTH_IDX]))
+            return fmi2Error;
+    return fmi2OK;
 }
 
 fmi2Status doCalc(OSMPCNetworkProxy component, fmi2Real currentCommunicationPoint, fmi2Real communicationStepSize, fmi2Boolean noSetFMUStatePriorToCurrentPoint)
 {
-    void* buffer=NULL;
-    int buffersize=0;
+    const void* buffer=NULL;
+    fmi2Integer buffersize=0;
 
     DEBUGBREAK();
 
     component->boolean_vars[FMI_BOOLEAN_INPUT_VALID_IDX]=fmi2False;
     component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2False;
 
-    buffer = decode_integer_to_pointer(component->integer_vars[FMI_INTEGER_SENSORDATA_IN_BASEHI_IDX],component->integer_vars[FMI_INTEGER_SENSORDATA_IN_BASELO_IDX]);
-    buffersize = component->integer_vars[FMI_INTEGER_SENSORDATA_IN_SIZE_IDX];
-
-    if (component->integer_vars[FMI_INTEGER_SENSORDATA_IN_SIZE_IDX] > 0) {
-        normal_log(component,"OSMP","Got %08X %08X LEN %08X, reading from %p (length %i)...",component->integer_vars[FMI_INTEGER_SENSORDATA_IN_BASEHI_IDX],component->integer_vars[FMI_INTEGER_SENSORDATA_IN_BASELO_IDX],buffersize,buffer,buffersize);
-        if (component->boolean_vars[FMI_BOOLEAN_LOG_DATA_IDX]) {
-            int i=0;
-            for (i=0;i<buffersize;i+=16) {
-                static char hexmap[]="0123456789ABCDEF";
-                char hexline[50];
-                char *ptr;
-                int j=0;
-                for (j=0,ptr=hexline;((i+j)<buffersize) && (j<16);j++) {
-                    unsigned char byte = ((unsigned char*)buffer)[i+j];
-                    *ptr++=' ';
-                    *ptr++=hexmap[byte>>4];
-                    *ptr++=hexmap[byte&0xF];
-                }
-                *ptr='\0';
-                normal_log(component,"OSMP","       %s",hexline);
-            }
-        }
-        component->boolean_vars[FMI_BOOLEAN_INPUT_VALID_IDX]=fmi2True;
-    }
+    if (FMU_CHANNELS > 1)
+        buffer = get_input_batch(component,&buffersize);
+    else
+        buffer = get_channel_input(component,0,&buffersize);
 
-    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->boolean_vars[FMI_BOOLEAN_SENDER_IDX]) {
-        if (ensure_tcp_proxy_connection(component)) {
-            int sendval=send(component->tcp_proxy_socket,(char*)&buffersize,sizeof(buffersize),0);
-            if (sendval!=sizeof(buffersize)) {
-#ifdef _WIN32
-                normal_log(component,"NET","Failed to send message size (%d): %d",buffersize,WSAGetLastError());
-#else
-                normal_log(component,"NET","Failed to send message size (%d): %d (%s)",buffersize,errno,strerror(errno));
-#endif
-                close_tcp_proxy_connection(component);
-            } else {
-                if (buffersize > 0) {
-                    sendval=send(component->tcp_proxy_socket,(char*)buffer,buffersize,0);
-                    if (sendval!=buffersize) {
-    #ifdef _WIN32
-                        normal_log(component,"NET","Failed to send message itself with size %d: %d",buffersize,WSAGetLastError());
-    #else
-                        normal_log(component,"NET","Failed to send message itself with size %d: %d (%s)",buffersize,errno,strerror(errno));
-    #endif
-                        close_tcp_proxy_connection(component);
-                    } else {
-                        normal_log(component,"NET","Successfully sent tcp message with size %d.",buffersize);
-                        component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
-                    }
-                } else {
-                    normal_log(component,"NET","Successfully sent empty tcp message with size %d.",buffersize);
-                    component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
-                }
-            }
-        }
+#ifdef FMU_ZEROMQ
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->boolean_vars[FMI_BOOLEAN_ZMQ_IDX]) {
+        if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX])
+            switch_output_buffers(component);
+        exchange_zmq_messages(component,buffer,buffersize);
     }
+#endif
 
-    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX]) {
-        /* Switch Buffers */
-        if (component->prev_output_buffer_ptr != NULL) {
-            free(component->prev_output_buffer_ptr);
-            component->prev_output_buffer_ptr=NULL;
-            component->prev_output_buffer_size=0;
-        }
-        component->prev_output_buffer_ptr = component->output_buffer_ptr;
-        component->prev_output_buffer_size = component->output_buffer_size;
-        component->output_buffer_ptr = NULL;
-        component->output_buffer_size = 0;
-        component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX] = 0;
-        component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX] = 0;
-        component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX] = 0;
+#ifndef _WIN32
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && is_shm_address(component)) {
+        int sent=0;
+        char* recv_buffer_ptr=NULL;
+        fmi2Integer recv_buffer_size=0;
+        if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX])
+            switch_output_buffers(component);
+        if (exchange_shm_messages(component,buffer,buffersize,&sent,&recv_buffer_ptr,&recv_buffer_size))
+            publish_output_buffer(component,recv_buffer_ptr,recv_buffer_size);
+        if (sent)
+            component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
+    }
+#endif
 
-        if (ensure_tcp_proxy_connection(component)) {
-            int recv_buffer_size=0;
+    if (!component->boolean_vars[FMI_BOOLEAN_DUMMY_IDX] && !component->boolean_vars[FMI_BOOLEAN_ZMQ_IDX] && !is_shm_address(component)) {
+        if (component->pipeline_depth > 0) {
+            exchange_pipelined(component,buffer,buffersize,currentCommunicationPoint+communicationStepSize);
+#ifdef FMU_LISTEN
+        } else if (component->broadcast_clients != NULL) {
+            if (broadcast_input(component,buffer,buffersize))
+                component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
+#endif
+        } else {
+            int sent=0;
             char* recv_buffer_ptr=NULL;
-            int recvval=0;
-            recvval=recv(component->tcp_proxy_socket,(char*)&(recv_buffer_size),sizeof(recv_buffer_size),MSG_WAITALL);
-            if (recvval!=sizeof(recv_buffer_size)) {
-#ifdef _WIN32
-                normal_log(component,"NET","Failed to recv message size (%d): %d",sizeof(recv_buffer_size),WSAGetLastError());
-#else
-                normal_log(component,"NET","Failed to recv message size (%d): %d (%s)",sizeof(recv_buffer_size),errno,strerror(errno));
-#endif
-                close_tcp_proxy_connection(component);
-            } else if (recv_buffer_size == 0) {
-                normal_log(component,"NET","Successfully recv empty tcp message with size %d.",recv_buffer_size);
-                component->boolean_vars[FMI_BOOLEAN_OUTPUT_RECEIVED_IDX] = fmi2True;
-                component->output_buffer_ptr = NULL;
-                component->output_buffer_size = recv_buffer_size;
-                component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX] = 0;
-                component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX] = 0;
-                component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX] = recv_buffer_size;
-                component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2False;
-            } else {
-                recv_buffer_ptr = calloc(recv_buffer_size,1);
-                if (recv_buffer_ptr == NULL) {
-                    normal_log(component,"NET","Failed to allocated recv message buffer of size (%d)",recv_buffer_size);
-                    close_tcp_proxy_connection(component);
-                } else {
-                    recvval=recv(component->tcp_proxy_socket,recv_buffer_ptr,recv_buffer_size,MSG_WAITALL);
-                    if (recvval!=recv_buffer_size) {
-#ifdef _WIN32
-                        normal_log(component,"NET","Failed to recv message itself with size %d: %d",recv_buffer_size,WSAGetLastError());
-#else
-                        normal_log(component,"NET","Failed to recv message itself with size %d: %d (%s)",recv_buffer_size,errno,strerror(errno));
-#endif
-                        close_tcp_proxy_connection(component);
-                    } else {
-                        normal_log(component,"NET","Successfully recv tcp message with size %d.",recv_buffer_size);
-                        component->boolean_vars[FMI_BOOLEAN_OUTPUT_RECEIVED_IDX] = fmi2True;
-                        component->output_buffer_ptr = recv_buffer_ptr;
-                        component->output_buffer_size = recv_buffer_size;
-                        encode_pointer_to_integer(recv_buffer_ptr,&(component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX]),&(component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX]));
-                        component->integer_vars[FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX] = recv_buffer_size;
-                        component->boolean_vars[FMI_BOOLEAN_OUTPUT_VALID_IDX] = fmi2True;
-                    }
-                }
-            }
+            fmi2Integer recv_buffer_size=0;
+            if (component->boolean_vars[FMI_BOOLEAN_RECEIVER_IDX])
+                switch_output_buffers(component);
+            if (exchange_tcp_messages(component,buffer,buffersize,&sent,&recv_buffer_ptr,&recv_buffer_size))
+                publish_output_buffer(component,recv_buffer_ptr,recv_buffer_size);
+            if (sent)
+                component->boolean_vars[FMI_BOOLEAN_INPUT_SENT_IDX]=fmi2True;
         }
+        if (wire_format_enabled(component) && component->pipeline_depth == 0)
+            update_compression_outputs(component,component->compression_bytes_in,component->compression_bytes_out,component->compression_time);
     }
 
     component->last_time=currentCommunicationPoint+communicationStepSize;
@@ -497,26 +2587,48 @@ fmi2Status doCalc(OSMPCNetworkProxy component, fmi2Real currentCommunicationPoin
 fmi2Status doTerm(OSMPCNetworkProxy component)
 {
     DEBUGBREAK();
+    stop_pipeline(component);
 #ifdef FMU_LISTEN
+    stop_broadcast_server(component);
     close_tcp_proxy_listen(component);
 #endif
     close_tcp_proxy_connection(component);
+#ifdef FMU_ZEROMQ
+    close_zmq_proxy_connection(component);
+#endif
+#ifndef _WIN32
+    close_shm_proxy_connection(component);
+#endif
+    close_log_data_file(component);
     return fmi2OK;
 }
 
 void doFree(OSMPCNetworkProxy component)
 {
     DEBUGBREAK();
+    stop_pipeline(component);
+#ifdef FMU_LISTEN
+    stop_broadcast_server(component);
+#endif
     if (component->prev_output_buffer_ptr!=NULL) {
-        free(component->prev_output_buffer_ptr);
+        release_output_buffer(component,component->prev_output_buffer_ptr);
         component->prev_output_buffer_ptr=NULL;
         component->prev_output_buffer_size=0;
     }
     if (component->output_buffer_ptr!=NULL) {
-        free(component->output_buffer_ptr);
+        release_output_buffer(component,component->output_buffer_ptr);
         component->output_buffer_ptr=NULL;
         component->output_buffer_size=0;
     }
+    free_receive_buffers(component);
+    free_compression_state(component);
+    free_log_data_state(component);
+    free(component->batch_buffer);
+    component->batch_buffer=NULL;
+    component->batch_capacity=0;
+#ifndef _WIN32
+    unmap_shm_proxy_segment(component);
+#endif
 }
 
 /*
@@ -539,26 +2651,12 @@ FMI2_Export fmi2Status fmi2SetDebugLogging(fmi2Component c, fmi2Boolean loggingO
     fmi_verbose_log(myc,"fmi2SetDebugLogging(%s)", loggingOn ? "true" : "false");
     myc->loggingOn = loggingOn ? 1 : 0;
 
-    for (;myc->loggingCategories!=NULL && myc->nCategories>0;) free(myc->loggingCategories[--(myc->nCategories)]);
-    free(myc->loggingCategories);
-    myc->loggingCategories = NULL;
-    myc->nCategories = 0;
-
     if (categories && (nCategories > 0)) {
-        myc->loggingCategories = calloc(nCategories,sizeof(char*));
-        if (myc->loggingCategories != NULL) {
-            size_t i;
-            myc->nCategories = nCategories;
-            for (i=0;i<nCategories;i++) myc->loggingCategories[i]=strdup(categories[i]);
-        }
+        size_t i;
+        myc->loggingCategories = 0;
+        for (i=0;i<nCategories;i++) myc->loggingCategories |= log_category(categories[i]);
     } else {
-        myc->loggingCategories = calloc(3,sizeof(char*));
-        if (myc->loggingCategories != NULL) {
-            myc->nCategories = 3;
-            myc->loggingCategories[0] = strdup("FMI");
-            myc->loggingCategories[1] = strdup("OSMP");
-            myc->loggingCategories[2] = strdup("NET");
-        }
+        myc->loggingCategories = LOG_CATEGORY_ALL;
     }
 
     return fmi2OK;
@@ -615,20 +2713,62 @@ FMI2_Export fmi2Component fmi2Instantiate(fmi2String instanceName,
     myc->last_time=0.0;
 #ifdef FMU_LISTEN
     myc->tcp_proxy_listen_socket=INVALID_SOCKET;
+    myc->broadcast_clients=NULL;
+    myc->broadcast_max_clients=0;
+    myc->broadcast_next_id=0;
+    myc->broadcast_free=NULL;
+#ifdef __linux__
+    myc->broadcast_epoll=-1;
+#else
+    myc->broadcast_pollfds=NULL;
+    myc->broadcast_pollclients=NULL;
+#endif
 #endif
     myc->tcp_proxy_socket=INVALID_SOCKET;
+#ifdef FMU_LISTEN
+    myc->tcp_proxy_listening=0;
+#else
+    myc->tcp_proxy_pending_socket=INVALID_SOCKET;
+#endif
+    myc->tcp_proxy_failures=0;
+    myc->tcp_proxy_retry_delay=0.0;
+    myc->tcp_proxy_retry_time=0.0;
+    myc->wire_negotiated=0;
+    myc->wire_send_codec=0;
+    myc->compress_buffer=NULL;
+    myc->compress_capacity=0;
+    myc->batch_buffer=NULL;
+    myc->batch_capacity=0;
+    myc->log_data_file=NULL;
+    myc->log_data_buffer=NULL;
+    myc->log_data_capacity=0;
+    myc->log_data_count=0;
+#ifdef FMU_ZSTD
+    myc->zstd_cctx=NULL;
+    myc->zstd_dctx=NULL;
+#endif
+#ifdef FMU_ZEROMQ
+    myc->zmq_proxy_socket=NULL;
+    myc->zmq_input_in_flight=0;
+#endif
+#ifndef _WIN32
+    myc->shm_segment=NULL;
+    myc->shm_segment_size=0;
+    myc->shm_held=0;
+#endif
     myc->output_buffer_ptr=NULL;
     myc->output_buffer_size=0;
     myc->prev_output_buffer_ptr=NULL;
     myc->prev_output_buffer_size=0;
+    myc->pool_buffers=NULL;
+    myc->pool_count=0;
+    myc->pool_hits=0;
+    myc->pool_misses=0;
+    osmp_mutex_init(&myc->pool_mutex);
+    myc->pipeline_depth=0;
+    myc->pipeline_slots=NULL;
 
-    myc->loggingCategories = calloc(3,sizeof(char*));
-    if (myc->loggingCategories != NULL) {
-        myc->nCategories = 3;
-        myc->loggingCategories[0] = strdup("FMI");
-        myc->loggingCategories[1] = strdup("OSMP");
-        myc->loggingCategories[2] = strdup("NET");
-    }
+    myc->loggingCategories = LOG_CATEGORY_ALL;
 
 #ifdef _WIN32
     if ((rc=WSAStartup(MAKEWORD(2,2),&WsaDat)) != 0) {
@@ -642,11 +2782,10 @@ FMI2_Export fmi2Component fmi2Instantiate(fmi2String instanceName,
             instanceName, fmuType, fmuGUID,
             (fmuResourceLocation != NULL) ? fmuResourceLocation : "<NULL>",
             "FUNCTIONS", visible, loggingOn);
+        osmp_mutex_destroy(&myc->pool_mutex);
         free(myc->fmuResourceLocation);
         free(myc->fmuGUID);
         free(myc->instanceName);
-        for (;myc->loggingCategories!=NULL && myc->nCategories>0;) free(myc->loggingCategories[--(myc->nCategories)]);
-        free(myc->loggingCategories);
         free(myc);
         return NULL;
     }
@@ -713,6 +2852,7 @@ FMI2_Export void fmi2FreeInstance(fmi2Component c)
     OSMPCNetworkProxy myc = (OSMPCNetworkProxy)c;
     fmi_verbose_log(myc,"fmi2FreeInstance()");
     doFree(myc);
+    osmp_mutex_destroy(&myc->pool_mutex);
 
 #ifdef FMU_LISTEN
     close_tcp_proxy_listen(myc);
@@ -725,8 +2865,6 @@ FMI2_Export void fmi2FreeInstance(fmi2Component c)
     free(myc->fmuResourceLocation);
     free(myc->fmuGUID);
     free(myc->instanceName);
-    for (;myc->loggingCategories!=NULL && myc->nCategories>0;) free(myc->loggingCategories[--(myc->nCategories)]);
-    free(myc->loggingCategories);
     free(myc);
 }
 
@@ -12,10 +12,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
-
-#if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
 #include <stdio.h>
-#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -23,19 +20,107 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/futex.h>
+#endif
+#include <poll.h>
 typedef int SOCKET;
 #endif
 #ifndef INVALID_SOCKET
 #define INVALID_SOCKET -1
 #endif
 
+#ifdef FMU_ZEROMQ
+#include <zmq.h>
+#endif
+
+#ifdef FMU_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef FMU_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Atomic Operations
+ *
+ * Minimal atomic operations on longs, for state that is shared with
+ * threads outside of the FMI calling thread (e.g. ZeroMQ I/O threads).
+ */
+#ifdef _WIN32
+#define osmp_atomic_load(ptr) InterlockedCompareExchange((ptr),0,0)
+#define osmp_atomic_store(ptr,value) InterlockedExchange((ptr),(value))
+#define osmp_atomic_cas(ptr,expected,desired) (InterlockedCompareExchange((ptr),(desired),(expected)) == (expected))
+#else
+#define osmp_atomic_load(ptr) __atomic_load_n((ptr),__ATOMIC_ACQUIRE)
+#define osmp_atomic_store(ptr,value) __atomic_store_n((ptr),(value),__ATOMIC_RELEASE)
+#define osmp_atomic_cas(ptr,expected,desired) __atomic_compare_exchange_n((ptr),&(long){(expected)},(desired),0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+#endif
+
+/*
+ * Threads
+ *
+ * Minimal portable threads, mutexes and condition variables, for the
+ * background I/O thread of pipelined operation.
+ */
+#ifdef _WIN32
+typedef HANDLE osmp_thread;
+typedef CRITICAL_SECTION osmp_mutex;
+typedef CONDITION_VARIABLE osmp_cond;
+#define OSMP_THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID arg)
+#define OSMP_THREAD_RETURN return 0
+#define osmp_thread_start(thread,function,arg) ((*(thread)=CreateThread(NULL,0,(function),(arg),0,NULL)) != NULL)
+#define osmp_thread_join(thread) (WaitForSingleObject((thread),INFINITE),CloseHandle(thread))
+#define osmp_mutex_init(mutex) InitializeCriticalSection(mutex)
+#define osmp_mutex_destroy(mutex) DeleteCriticalSection(mutex)
+#define osmp_mutex_lock(mutex) EnterCriticalSection(mutex)
+#define osmp_mutex_unlock(mutex) LeaveCriticalSection(mutex)
+#define osmp_cond_init(cond) InitializeConditionVariable(cond)
+#define osmp_cond_destroy(cond)
+#define osmp_cond_wait(cond,mutex) SleepConditionVariableCS((cond),(mutex),INFINITE)
+#define osmp_cond_broadcast(cond) WakeAllConditionVariable(cond)
+#else
+typedef pthread_t osmp_thread;
+typedef pthread_mutex_t osmp_mutex;
+typedef pthread_cond_t osmp_cond;
+#define OSMP_THREAD_FUNCTION(name) void* name(void* arg)
+#define OSMP_THREAD_RETURN return NULL
+#define osmp_thread_start(thread,function,arg) (pthread_create((thread),NULL,(function),(arg)) == 0)
+#define osmp_thread_join(thread) pthread_join((thread),NULL)
+#define osmp_mutex_init(mutex) pthread_mutex_init((mutex),NULL)
+#define osmp_mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#define osmp_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define osmp_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#define osmp_cond_init(cond) pthread_cond_init((cond),NULL)
+#define osmp_cond_destroy(cond) pthread_cond_destroy(cond)
+#define osmp_cond_wait(cond,mutex) pthread_cond_wait((cond),(mutex))
+#define osmp_cond_broadcast(cond) pthread_cond_broadcast(cond)
+#endif
+#ifdef _MSC_VER
+#define OSMP_THREAD_LOCAL __declspec(thread)
+#else
+#define OSMP_THREAD_LOCAL __thread
+#endif
+
 #ifndef FMU_SHARED_OBJECT
 #define FMI2_FUNCTION_PREFIX OSMPCNetworkProxy_
 #endif
 #include "fmi2Functions.h"
+#include "OSMPBinaryVariable.h"
 
 /*
  * Logging Control
@@ -50,6 +135,17 @@ typedef int SOCKET;
  *   FMI calls is enabled, which can get very verbose.
  */
 
+/*
+ * Logging Categories
+ *
+ * Categories are kept as a bitmask, so that disabled log messages
+ * can be skipped before any formatting takes place.
+ */
+#define LOG_CATEGORY_FMI 0x1
+#define LOG_CATEGORY_OSMP 0x2
+#define LOG_CATEGORY_NET 0x4
+#define LOG_CATEGORY_ALL (LOG_CATEGORY_FMI|LOG_CATEGORY_OSMP|LOG_CATEGORY_NET)
+
 /*
  * Variable Definitions
  *
@@ -63,6 +159,11 @@ typedef int SOCKET;
  * array variables.
  */
 
+/* Number of OSMP inputs and outputs, exchanged as one batch per step if more than one */
+#ifndef FMU_CHANNELS
+#define FMU_CHANNELS 1
+#endif
+
 /* Boolean Variables */
 #define FMI_BOOLEAN_DUMMY_IDX 0
 #define FMI_BOOLEAN_SENDER_IDX 1
@@ -84,17 +185,44 @@ typedef int SOCKET;
 #define FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX 3
 #define FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX 4
 #define FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX 5
-#define FMI_INTEGER_LAST_IDX FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX
+#define FMI_INTEGER_SEND_BUFFER_SIZE_IDX 6
+#define FMI_INTEGER_RECV_BUFFER_SIZE_IDX 7
+#define FMI_INTEGER_PIPELINE_DEPTH_IDX 8
+#define FMI_INTEGER_MAX_CLIENTS_IDX 9
+#define FMI_INTEGER_CLIENT_QUEUE_LENGTH_IDX 10
+#define FMI_INTEGER_BACKPRESSURE_IDX 11
+#define FMI_INTEGER_CLIENTS_IDX 12
+#define FMI_INTEGER_COMPRESSION_THRESHOLD_IDX 13
+#define FMI_INTEGER_CONNECT_TIMEOUT_IDX 14
+#define FMI_INTEGER_RECONNECT_BACKOFF_IDX 15
+#define FMI_INTEGER_RECONNECT_BACKOFF_MAX_IDX 16
+#define FMI_INTEGER_LOG_DATA_SAMPLING_IDX 17
+/* Further channels (FMU_CHANNELS > 1) follow, with six variables each (CMakeLists.txt reads this index) */
+#define FMI_INTEGER_CHANNELS_IDX 18
+#define FMI_INTEGER_LAST_IDX (FMI_INTEGER_CHANNELS_IDX+(FMU_CHANNELS-1)*6-1)
 #define FMI_INTEGER_VARS (FMI_INTEGER_LAST_IDX+1)
 
+/* Variables of the zero-based channel c, the first channel being SENSORDATA_IN/OUT */
+#define FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c) ((c) == 0 ? FMI_INTEGER_SENSORDATA_IN_BASELO_IDX : FMI_INTEGER_CHANNELS_IDX+((c)-1)*6)
+#define FMI_INTEGER_CHANNEL_IN_BASEHI_IDX(c) (FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c)+1)
+#define FMI_INTEGER_CHANNEL_IN_SIZE_IDX(c) (FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c)+2)
+#define FMI_INTEGER_CHANNEL_OUT_BASELO_IDX(c) (FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c)+3)
+#define FMI_INTEGER_CHANNEL_OUT_BASEHI_IDX(c) (FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c)+4)
+#define FMI_INTEGER_CHANNEL_OUT_SIZE_IDX(c) (FMI_INTEGER_CHANNEL_IN_BASELO_IDX(c)+5)
+
 /* Real Variables */
-#define FMI_REAL_LAST_IDX 0
+#define FMI_REAL_OUTPUT_LATENCY_IDX 0
+#define FMI_REAL_COMPRESSION_RATIO_IDX 1
+#define FMI_REAL_COMPRESSION_TIME_IDX 2
+#define FMI_REAL_LAST_IDX FMI_REAL_COMPRESSION_TIME_IDX
 #define FMI_REAL_VARS (FMI_REAL_LAST_IDX+1)
 
 /* String Variables */
 #define FMI_STRING_ADDRESS_IDX 0
 #define FMI_STRING_PORT_IDX 1
-#define FMI_STRING_LAST_IDX FMI_STRING_PORT_IDX
+#define FMI_STRING_COMPRESSION_IDX 2
+#define FMI_STRING_LOG_DATA_FILE_IDX 3
+#define FMI_STRING_LAST_IDX FMI_STRING_LOG_DATA_FILE_IDX
 #define FMI_STRING_VARS (FMI_STRING_LAST_IDX+1)
 
 /* Callbacks without const */
@@ -106,6 +234,126 @@ typedef struct {
    fmi2ComponentEnvironment   componentEnvironment;
 } fmi2CallbackFunctionsVar;
 
+/* Wire Format Hello, exchanged on connecting if compression is set */
+typedef struct OSMPCNetworkProxyWireHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t codecs;
+} OSMPCNetworkProxyWireHello;
+
+/* Wire Format Message Header, following the message size */
+typedef struct OSMPCNetworkProxyWireHeader {
+    uint32_t codec;
+    fmi2Integer size;
+} OSMPCNetworkProxyWireHeader;
+
+/* Channel Batch Header (FMU_CHANNELS > 1), followed by the data of all channels in order */
+typedef struct OSMPCNetworkProxyBatchHeader {
+    fmi2Integer channels;
+    fmi2Integer sizes[FMU_CHANNELS];
+} OSMPCNetworkProxyBatchHeader;
+
+/* Receive Buffer, owned by the receive buffer pool */
+typedef struct OSMPCNetworkProxyBuffer {
+    char* ptr;
+    size_t capacity;
+    int in_use;
+} OSMPCNetworkProxyBuffer;
+
+#ifdef FMU_LISTEN
+/* Broadcast Message:  One framed input, shared by all client queues */
+typedef struct OSMPCNetworkProxyBroadcastMessage {
+    int refs;
+    size_t size;
+    size_t capacity;
+    /* Next released message, while on the free list */
+    struct OSMPCNetworkProxyBroadcastMessage* next;
+    char data[1];
+} OSMPCNetworkProxyBroadcastMessage;
+
+/* Broadcast Client:  Connection, send queue and statistics */
+typedef struct OSMPCNetworkProxyClient {
+    SOCKET socket;
+    int id;
+    char address[64];
+    OSMPCNetworkProxyBroadcastMessage** queue;
+    int queue_head, queue_count;
+    size_t queue_offset;
+    unsigned long long messages_sent, bytes_sent, messages_dropped, blocked_steps;
+    int max_queued;
+} OSMPCNetworkProxyClient;
+#endif
+
+/* Pipeline Slot:  Input of one step and the output received for it */
+typedef struct OSMPCNetworkProxyPipelineSlot {
+    char* input_ptr;
+    size_t input_capacity;
+    fmi2Integer input_size;
+    double time;
+    int sent;
+    int received;
+    char* output_ptr;
+    fmi2Integer output_size;
+    /* Compression counters after the exchange, published when the slot is collected */
+    unsigned long long compression_bytes_in, compression_bytes_out;
+    double compression_time;
+    /* Messages logged during the exchange, as category and message strings */
+    char* log_ptr;
+    size_t log_size, log_capacity;
+} OSMPCNetworkProxyPipelineSlot;
+
+#ifndef _WIN32
+/*
+ * Shared Memory Segment
+ *
+ * A segment holds two rings, one per direction, each with its control
+ * block on the header page and its data area after it.  Fields are
+ * grouped by the side writing them, to keep them on separate cache
+ * lines.  Positions are running byte counts, taken modulo capacity.
+ */
+#define OSMP_SHM_MAGIC 0x504D534FU
+#define OSMP_SHM_VERSION 1
+#define OSMP_SHM_ALIGN 64
+#define OSMP_SHM_RECORD_WRAP 0x1U
+#define OSMP_SHM_PEER_ATTACHED 1
+#define OSMP_SHM_PEER_DETACHED 2
+
+/* Ring Control Block */
+typedef struct OSMPCNetworkProxyShmRing {
+    /* Written by the creator on setup */
+    uint64_t offset;
+    uint64_t capacity;
+    char pad0[OSMP_SHM_ALIGN-2*sizeof(uint64_t)];
+    /* Written by the producer (data_waiters by the consumer) */
+    uint64_t head;
+    uint32_t data_seq;
+    uint32_t data_waiters;
+    char pad1[OSMP_SHM_ALIGN-sizeof(uint64_t)-2*sizeof(uint32_t)];
+    /* Written by the consumer (space_waiters by the producer) */
+    uint64_t read;
+    uint64_t tail;
+    uint32_t space_seq;
+    uint32_t space_waiters;
+    char pad2[OSMP_SHM_ALIGN-2*sizeof(uint64_t)-2*sizeof(uint32_t)];
+} OSMPCNetworkProxyShmRing;
+
+/* Segment Header:  Ring 0 carries messages to the creating side, ring 1 from it */
+typedef struct OSMPCNetworkProxyShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t peer_state[2];
+    char pad[OSMP_SHM_ALIGN-4*sizeof(uint32_t)];
+    OSMPCNetworkProxyShmRing rings[2];
+} OSMPCNetworkProxyShmHeader;
+
+/* Record Header, preceding each message in a ring */
+typedef struct OSMPCNetworkProxyShmRecord {
+    uint32_t size;
+    uint32_t flags;
+    uint64_t end;
+} OSMPCNetworkProxyShmRecord;
+#endif
+
 /* FMU Instance */
 typedef struct OSMPCNetworkProxy {
     /* Members */
@@ -115,8 +363,7 @@ typedef struct OSMPCNetworkProxy {
     char* fmuResourceLocation;
     int visible;
     int loggingOn;
-    size_t nCategories;
-    char** loggingCategories;
+    unsigned int loggingCategories;
     fmi2CallbackFunctionsVar functions;
     fmi2Boolean boolean_vars[FMI_BOOLEAN_VARS];
     fmi2Integer integer_vars[FMI_INTEGER_VARS];
@@ -127,12 +374,80 @@ typedef struct OSMPCNetworkProxy {
     /* Proxy Connections */
     #ifdef FMU_LISTEN
     SOCKET tcp_proxy_listen_socket;
+    /* Broadcast Server (broadcast_clients is NULL unless maxClients > 0) */
+    OSMPCNetworkProxyClient* broadcast_clients;
+    int broadcast_max_clients;
+    int broadcast_queue_length;
+    int broadcast_next_id;
+    OSMPCNetworkProxyBroadcastMessage* broadcast_free;
+    #ifdef __linux__
+    int broadcast_epoll;
+    #else
+    struct pollfd* broadcast_pollfds;
+    OSMPCNetworkProxyClient** broadcast_pollclients;
+    #endif
     #endif
     SOCKET tcp_proxy_socket;
+    /* Connection Establishment (listen or connect in progress, retry backoff) */
+    #ifdef FMU_LISTEN
+    int tcp_proxy_listening;
+    #else
+    SOCKET tcp_proxy_pending_socket;
+    #endif
+    int tcp_proxy_failures;
+    double tcp_proxy_retry_delay;
+    double tcp_proxy_retry_time;
+    #ifdef FMU_ZEROMQ
+    void* zmq_proxy_socket;
+    /* Set while ZeroMQ still references the OSMP input buffer */
+    volatile long zmq_input_in_flight;
+    #endif
+    #ifndef _WIN32
+    OSMPCNetworkProxyShmHeader* shm_segment;
+    size_t shm_segment_size;
+    /* Number of received messages still referenced as output */
+    int shm_held;
+    #endif
+
+    /* Wire Format (negotiated per connection) and Compression */
+    int wire_negotiated;
+    int wire_send_codec;
+    fmi2Integer compression_threshold;
+    char* compress_buffer;
+    size_t compress_capacity;
+    unsigned long long compression_bytes_in, compression_bytes_out;
+    double compression_time;
+    #ifdef FMU_ZSTD
+    ZSTD_CCtx* zstd_cctx;
+    ZSTD_DCtx* zstd_dctx;
+    #endif
+
+    /* Channel Batch (assembled input of all channels) */
+    char* batch_buffer;
+    size_t batch_capacity;
+
+    /* Data Logging (hex dump buffer or binary trace file) */
+    FILE* log_data_file;
+    char* log_data_buffer;
+    size_t log_data_capacity;
+    unsigned long long log_data_count;
 
     /* Buffering */
     size_t output_buffer_size, prev_output_buffer_size;
     char *output_buffer_ptr, *prev_output_buffer_ptr;
+    OSMPCNetworkProxyBuffer* pool_buffers;
+    int pool_count;
+    unsigned long pool_hits, pool_misses;
+    osmp_mutex pool_mutex;
+
+    /* Pipelined Operation (pipeline_depth is 0 unless the I/O thread is running) */
+    int pipeline_depth;
+    OSMPCNetworkProxyPipelineSlot* pipeline_slots;
+    unsigned long pipeline_submitted, pipeline_completed, pipeline_collected;
+    int pipeline_stop;
+    osmp_thread pipeline_thread;
+    osmp_mutex pipeline_mutex;
+    osmp_cond pipeline_changed;
 } *OSMPCNetworkProxy;
 
 /* Private File-based Logging just for Debugging */
@@ -158,38 +473,90 @@ void fmi_verbose_log_global(const char* format, ...)
 #endif
 }
 
-void internal_log(OSMPCNetworkProxy component,const char* category, const char* format, va_list arg)
+unsigned int log_category(const char* category)
 {
-#if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
-    char buffer[1024];
-#ifdef _WIN32
-    vsnprintf_s(buffer, 1024, _TRUNCATE, format, arg);
+    if (0==strcmp(category,"FMI"))
+        return LOG_CATEGORY_FMI;
+    else if (0==strcmp(category,"OSMP"))
+        return LOG_CATEGORY_OSMP;
+    else if (0==strcmp(category,"NET"))
+        return LOG_CATEGORY_NET;
+    return 0;
+}
+
+/* Checked before formatting:  Both the private log and the FMI logger honor loggingOn and the categories */
+int log_enabled(OSMPCNetworkProxy component,const char* category)
+{
+#if defined(PRIVATE_LOG_PATH)
+    return component->loggingOn && (component->loggingCategories & log_category(category)) != 0;
+#elif defined(PUBLIC_LOGGING)
+    return component->loggingOn && (component->loggingCategories & log_category(category)) != 0;
 #else
-    vsnprintf(buffer, 1024, format, arg);
-    buffer[1023]='\0';
+    return 0;
 #endif
+}
+
+/*
+ * The FMI logger must only be called from the threads calling into the
+ * FMU, so messages of the pipeline I/O thread are kept with the slot it
+ * is exchanging, and logged by the thread collecting that slot.
+ */
+static OSMP_THREAD_LOCAL OSMPCNetworkProxyPipelineSlot* deferred_log_slot = NULL;
+
+void defer_log_message(OSMPCNetworkProxyPipelineSlot* slot, const char* category, const char* message)
+{
+    size_t category_length = strlen(category)+1;
+    size_t message_length = strlen(message)+1;
+    size_t needed = slot->log_size+category_length+message_length;
+    if (needed > slot->log_capacity) {
+        size_t capacity = slot->log_capacity > 0 ? slot->log_capacity : 1024;
+        char* log;
+        while (capacity < needed)
+            capacity *= 2;
+        log = realloc(slot->log_ptr,capacity);
+        /* Nothing to report the failure to, the message is lost */
+        if (log == NULL)
+            return;
+        slot->log_ptr = log;
+        slot->log_capacity = capacity;
+    }
+    memcpy(slot->log_ptr+slot->log_size,category,category_length);
+    memcpy(slot->log_ptr+slot->log_size+category_length,message,message_length);
+    slot->log_size = needed;
+}
+
+/* Passes an already formatted message of any length to the private log and/or the FMI logger */
+void log_message(OSMPCNetworkProxy component,const char* category, const char* message)
+{
+    if (deferred_log_slot != NULL) {
+        defer_log_message(deferred_log_slot,category,message);
+        return;
+    }
 #ifdef PRIVATE_LOG_PATH
     if (private_log_file == NULL)
         private_log_file = fopen(PRIVATE_LOG_PATH,"a");
     if (private_log_file != NULL) {
-        fprintf(private_log_file,"OSMPCNetworkProxy::%s<%p>: %s\n",component->instanceName,component,buffer);
+        fprintf(private_log_file,"OSMPCNetworkProxy::%s<%p>: %s\n",component->instanceName,component,message);
         fflush(private_log_file);
     }
 #endif
 #ifdef PUBLIC_LOGGING
-    if (component->loggingOn) {
-        size_t i;
-        int active = component->nCategories == 0;
-        for (i=0;i<component->nCategories;i++) {
-            if (0==strcmp(category,component->loggingCategories[i])) {
-                active = 1;
-                break;
-            }
-        }
-        if (active)
-            component->functions.logger(component->functions.componentEnvironment,component->instanceName,fmi2OK,category,buffer);
-    }
+    if (component->loggingOn && (component->loggingCategories & log_category(category)))
+        component->functions.logger(component->functions.componentEnvironment,component->instanceName,fmi2OK,category,message);
+#endif
+}
+
+void internal_log(OSMPCNetworkProxy component,const char* category, const char* format, va_list arg)
+{
+#if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
+    char buffer[1024];
+#ifdef _WIN32
+    vsnprintf_s(buffer, 1024, _TRUNCATE, format, arg);
+#else
+    vsnprintf(buffer, 1024, format, arg);
+    buffer[1023]='\0';
 #endif
+    log_message(component,category,buffer);
 #endif
 }
 
@@ -197,6 +564,8 @@ void fmi_verbose_log(OSMPCNetworkProxy component,const char* format, ...)
 {
 #if defined(VERBOSE_FMI_LOGGING) && (defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING))
     va_list ap;
+    if (!log_enabled(component,"FMI"))
+        return;
     va_start(ap, format);
     internal_log(component,"FMI",format,ap);
     va_end(ap);
@@ -207,6 +576,8 @@ void fmi_verbose_log(OSMPCNetworkProxy component,const char* format, ...)
 void normal_log(OSMPCNetworkProxy component, const char* category, const char* format, ...) {
 #if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
     va_list ap;
+    if (!log_enabled(component,category))
+        return;
     va_start(ap, format);
     internal_log(component,category,format,ap);
     va_end(ap);
@@ -0,0 +1,194 @@
+/*
+ * PMSF FMU Framework for FMI 2.0 Co-Simulation FMUs
+ *
+ * (C) 2016 -- 2018 PMSF IT Consulting Pierre R. Mai
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Detection Kernel Test
+ *
+ * Runs random and edge case positions, orientations and ranges through
+ * the DetectionBatch kernel this file is compiled for (AVX2, SSE2 or
+ * scalar, depending on the compiler flags), and compares the results
+ * bit for bit against rotatePoint and the scalar range and field of
+ * view test.  Exits with a non-zero status on any difference, or with
+ * SKIP_STATUS if the machine cannot run the kernel.
+ */
+
+#include "OSMPDummySensor.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#if defined(SCALAR_DETECTION_KERNEL)
+#define KERNEL_NAME "scalar"
+#elif defined(__AVX2__)
+#define KERNEL_NAME "AVX2"
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNEL_NAME "SSE2"
+#else
+#define KERNEL_NAME "scalar"
+#endif
+
+#define SKIP_STATUS 77
+
+void rotatePoint(double x, double y, double z,double yaw,double pitch,double roll,double &rx,double &ry,double &rz);
+
+struct TestObject {
+    double x, y, z;
+    double yaw, pitch, roll;
+};
+
+static const double PI = 3.14159265358979323846;
+
+static int checks = 0;
+static int mismatches = 0;
+
+static bool same_bits(double a, double b)
+{
+    return memcmp(&a,&b,sizeof(double)) == 0;
+}
+
+/* Runs one batch through the kernel and checks every result against the reference */
+static void check_batch(const vector<TestObject>& objects, double ego_x, double ego_y, double ego_z, double range)
+{
+    osi3::GroundTruth gt;
+    vector<int> indices;
+    for (size_t k = 0; k < objects.size(); k++) {
+        osi3::BaseMoving* base = gt.add_moving_object()->mutable_base();
+        base->mutable_position()->set_x(objects[k].x);
+        base->mutable_position()->set_y(objects[k].y);
+        base->mutable_position()->set_z(objects[k].z);
+        base->mutable_orientation()->set_yaw(objects[k].yaw);
+        base->mutable_orientation()->set_pitch(objects[k].pitch);
+        base->mutable_orientation()->set_roll(objects[k].roll);
+        indices.push_back((int)k);
+    }
+
+    DetectionBatch batch;
+    batch.extract(gt,indices,ego_x,ego_y,ego_z);
+    batch.transform_and_test(range);
+
+    for (size_t k = 0; k < objects.size(); k++) {
+        const TestObject& obj = objects[k];
+        double ref_x,ref_y,ref_z;
+        rotatePoint(obj.x-ego_x,obj.y-ego_y,obj.z-ego_z,obj.yaw,obj.pitch,obj.roll,ref_x,ref_y,ref_z);
+        double ref_distance = sqrt(ref_x*ref_x + ref_y*ref_y + ref_z*ref_z);
+        bool ref_detected = (ref_distance <= range) && (ref_x/ref_distance > 0.866025);
+        checks++;
+        if (!same_bits(batch.rel_x[k],ref_x) || !same_bits(batch.rel_y[k],ref_y) || !same_bits(batch.rel_z[k],ref_z) || !same_bits(batch.distance[k],ref_distance) || !!batch.detected[k] != ref_detected) {
+            if (mismatches < 20)
+                fprintf(stderr,"Mismatch at %d of %d (range %.17g): %.17g,%.17g,%.17g (%.17g) %s vs. reference %.17g,%.17g,%.17g (%.17g) %s\n",
+                    (int)k,(int)objects.size(),range,
+                    batch.rel_x[k],batch.rel_y[k],batch.rel_z[k],batch.distance[k],batch.detected[k] ? "detected" : "ignored",
+                    ref_x,ref_y,ref_z,ref_distance,ref_detected ? "detected" : "ignored");
+            mismatches++;
+        }
+    }
+}
+
+/* Checks the objects at every lane position and with every remainder the vector loop can leave */
+static void check_shifted(const vector<TestObject>& objects, double ego_x, double ego_y, double ego_z, double range)
+{
+    for (size_t shift = 0; shift < 4 && shift < objects.size(); shift++)
+        check_batch(vector<TestObject>(objects.begin()+shift,objects.end()),ego_x,ego_y,ego_z,range);
+}
+
+static double reference_distance(const TestObject& obj)
+{
+    double rx,ry,rz;
+    rotatePoint(obj.x,obj.y,obj.z,obj.yaw,obj.pitch,obj.roll,rx,ry,rz);
+    return sqrt(rx*rx + ry*ry + rz*rz);
+}
+
+int main()
+{
+#if defined(__AVX2__) && !defined(SCALAR_DETECTION_KERNEL) && (defined(__GNUC__) || defined(__clang__))
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("Detection kernel (%s): not supported by this machine, skipped\n",KERNEL_NAME);
+        return SKIP_STATUS;
+    }
+#endif
+
+    std::mt19937_64 rng(20181016);
+    std::uniform_real_distribution<double> position(-300.0,300.0);
+    std::uniform_real_distribution<double> height(-5.0,5.0);
+    std::uniform_real_distribution<double> angle(-PI,PI);
+    std::uniform_real_distribution<double> tilt(-0.1,0.1);
+    std::uniform_real_distribution<double> ranges(0.0,350.0);
+
+    /* Random traffic around random ego positions, with flat and arbitrary orientations */
+    for (int round = 0; round < 200; round++) {
+        vector<TestObject> objects(1 + rng() % 67);
+        bool flat = (round % 2) == 0;
+        for (size_t k = 0; k < objects.size(); k++) {
+            TestObject& obj = objects[k];
+            obj.x = position(rng); obj.y = position(rng); obj.z = height(rng);
+            obj.yaw = angle(rng);
+            obj.pitch = flat ? tilt(rng) : angle(rng);
+            obj.roll = flat ? tilt(rng) : angle(rng);
+        }
+        check_shifted(objects,position(rng),position(rng),height(rng),ranges(rng));
+    }
+
+    /* Special orientations and positions in all combinations */
+    const double special_angles[] = { 0.0, -0.0, PI/2, -PI/2, PI, -PI, PI/4, 1e-310, 1e6 };
+    const double special_positions[][3] = {
+        { 0.0, 0.0, 0.0 }, { -0.0, -0.0, -0.0 }, { 1.0, 0.0, 0.0 }, { 0.0, -1.0, 0.0 }, { 0.0, 0.0, 1.0 },
+        { 1e-300, 1e-300, 0.0 }, { 1e200, 0.0, 0.0 }, { -1e200, 1e200, 0.0 }, { 100.0, 57.7, 0.0 }, { 135.0, 0.0, 0.0 }
+    };
+    const double special_ranges[] = { 0.0, 1.0, 135.0*1.1, std::numeric_limits<double>::infinity() };
+    vector<TestObject> specials;
+    for (size_t p = 0; p < sizeof(special_positions)/sizeof(special_positions[0]); p++)
+        for (size_t a = 0; a < sizeof(special_angles)/sizeof(special_angles[0]); a++)
+            for (size_t b = 0; b < sizeof(special_angles)/sizeof(special_angles[0]); b++)
+                for (size_t c = 0; c < sizeof(special_angles)/sizeof(special_angles[0]); c++) {
+                    TestObject obj = { special_positions[p][0], special_positions[p][1], special_positions[p][2], special_angles[a], special_angles[b], special_angles[c] };
+                    specials.push_back(obj);
+                }
+    for (size_t r = 0; r < sizeof(special_ranges)/sizeof(special_ranges[0]); r++)
+        check_shifted(specials,0.0,0.0,0.0,special_ranges[r]);
+
+    /* Objects exactly at and just inside/outside the range, at every lane position */
+    for (int round = 0; round < 100; round++) {
+        TestObject edge = { position(rng), position(rng), height(rng), angle(rng), tilt(rng), tilt(rng) };
+        double d = reference_distance(edge);
+        const double edge_ranges[] = { d, nextafter(d,0.0), nextafter(d,d+1.0) };
+        for (size_t r = 0; r < 3; r++)
+            for (size_t slot = 0; slot < 9; slot++) {
+                vector<TestObject> objects(9);
+                for (size_t k = 0; k < objects.size(); k++) {
+                    TestObject obj = { position(rng), position(rng), height(rng), angle(rng), tilt(rng), tilt(rng) };
+                    objects[k] = (k == slot) ? edge : obj;
+                }
+                check_batch(objects,0.0,0.0,0.0,edge_ranges[r]);
+            }
+    }
+
+    /* Objects on and a few ulps around the edge of the field of view */
+    vector<TestObject> cone;
+    const double half_angle = acos(0.866025);
+    for (int side = -1; side <= 1; side += 2)
+        for (int scale = 1; scale <= 1000; scale *= 10) {
+            double x = scale*cos(half_angle), y = side*scale*sin(half_angle);
+            for (int ulps = -3; ulps <= 3; ulps++) {
+                double nudged = x;
+                for (int u = 0; u < (ulps < 0 ? -ulps : ulps); u++)
+                    nudged = nextafter(nudged,ulps < 0 ? 0.0 : 2.0*x);
+                TestObject obj = { nudged, y, 0.0, 0.0, 0.0, 0.0 };
+                cone.push_back(obj);
+            }
+        }
+    check_shifted(cone,0.0,0.0,0.0,2000.0);
+
+    printf("Detection kernel (%s): %d of %d results differ from the reference\n",KERNEL_NAME,mismatches,checks);
+    return mismatches ? 1 : 0;
+}
@@ -47,65 +47,29 @@
 #include <string>
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <cmath>
+#if defined(SCALAR_DETECTION_KERNEL)
+/* Plain C++ detection kernel only, e.g. for testing it on SIMD machines */
+#elif defined(__AVX2__)
+#define OSMP_USE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OSMP_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-#ifdef PRIVATE_LOG_PATH
-ofstream COSMPDummySensor::private_log_file;
-#endif
-
 /*
  * ProtocolBuffer Accessors
  */
 
-void* decode_integer_to_pointer(fmi2Integer hi,fmi2Integer lo)
-{
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.base.lo=lo;
-    myaddr.base.hi=hi;
-    return reinterpret_cast<void*>(myaddr.address);
-#elif PTRDIFF_MAX == INT32_MAX
-    return reinterpret_cast<void*>(lo);
-#else
-#error "Cannot determine 32bit or 64bit environment!"
-#endif
-}
-
-void encode_pointer_to_integer(const void* ptr,fmi2Integer& hi,fmi2Integer& lo)
-{
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.address=reinterpret_cast<unsigned long long>(ptr);
-    hi=myaddr.base.hi;
-    lo=myaddr.base.lo;
-#elif PTRDIFF_MAX == INT32_MAX
-    hi=0;
-    lo=reinterpret_cast<int>(ptr);
-#else
-#error "Cannot determine 32bit or 64bit environment!"
-#endif
-}
-
 bool COSMPDummySensor::get_fmi_sensor_view_config(osi3::SensorViewConfiguration& data)
 {
-    if (integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_SIZE_IDX] > 0) {
-        void* buffer = decode_integer_to_pointer(integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASELO_IDX]);
-        normal_log("OSMP","Got %08X %08X, reading from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASELO_IDX],buffer);
-        data.ParseFromArray(buffer,integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_SIZE_IDX]);
+    if (sensorViewConfig.valid()) {
+        normal_log("OSMP","Got %08X %08X, reading from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_BASELO_IDX],sensorViewConfig.data());
+        sensorViewConfig.parse(data);
         return true;
     } else {
         return false;
@@ -114,46 +78,74 @@ bool COSMPDummySensor::get_fmi_sensor_view_config(osi3::SensorViewConfiguration&
 
 void COSMPDummySensor::set_fmi_sensor_view_config_request(const osi3::SensorViewConfiguration& data)
 {
-    data.SerializeToString(currentConfigRequestBuffer);
-    encode_pointer_to_integer(currentConfigRequestBuffer->data(),integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASELO_IDX]);
-    integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_SIZE_IDX]=(fmi2Integer)currentConfigRequestBuffer->length();
-    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASELO_IDX],currentConfigRequestBuffer->data());
-    swap(currentConfigRequestBuffer,lastConfigRequestBuffer);
+    const char* buffer = sensorViewConfigRequest.set(data);
+    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASELO_IDX],buffer);
 }
 
 void COSMPDummySensor::reset_fmi_sensor_view_config_request()
 {
-    integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_SIZE_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASEHI_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASELO_IDX]=0;
+    sensorViewConfigRequest.reset();
+}
+
+/*
+ * Number of repeated ground truth entries held by a SensorView.  Parsing
+ * into a message clears it first, but keeps the storage of cleared
+ * repeated entries (and their nested sub-messages) for reuse, so this
+ * is the number of entries a re-parse can fill without allocating.
+ */
+static size_t count_ground_truth_entries(const osi3::SensorView& data)
+{
+    const osi3::GroundTruth& gt = data.global_ground_truth();
+    return gt.moving_object_size() + gt.stationary_object_size() + gt.lane_size() + gt.lane_boundary_size();
 }
 
 bool COSMPDummySensor::get_fmi_sensor_view_in(osi3::SensorView& data)
 {
-    if (integer_vars[FMI_INTEGER_SENSORVIEW_IN_SIZE_IDX] > 0) {
-        void* buffer = decode_integer_to_pointer(integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASELO_IDX]);
-        normal_log("OSMP","Got %08X %08X, reading from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASELO_IDX],buffer);
-        data.ParseFromArray(buffer,integer_vars[FMI_INTEGER_SENSORVIEW_IN_SIZE_IDX]);
+    if (sensorViewIn.valid()) {
+        normal_log("OSMP","Got %08X %08X, reading from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_IN_BASELO_IDX],sensorViewIn.data());
+        size_t retained = count_ground_truth_entries(data);
+        sensorViewIn.parse(data,fmi_sensor_view_output_mode() == SENSORVIEW_OUTPUT_MODE_COPY ? NULL : &sensorViewInMask);
+        size_t reused = min(retained,count_ground_truth_entries(data));
+        reusedInputEntries += reused;
+        normal_log("OSMP","Reused storage of %llu ground truth entries (%llu in total)",(unsigned long long)reused,reusedInputEntries);
         return true;
     } else {
         return false;
     }
 }
 
+size_t COSMPDummySensor::fmi_sensor_view_in_splice_header(uint8_t* header)
+{
+    using google::protobuf::internal::WireFormatLite;
+
+    /*
+     * Header for encoding the unmodified input bytes as an additional
+     * sensor_view field: The wire format allows fields to appear in any
+     * order, and repeated message fields simply accumulate.
+     */
+    uint8_t* end = WireFormatLite::WriteTagToArray(osi3::SensorData::kSensorViewFieldNumber,WireFormatLite::WIRETYPE_LENGTH_DELIMITED,header);
+    end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray((uint32_t)sensorViewIn.size(),end);
+    return end-header;
+}
+
 void COSMPDummySensor::set_fmi_sensor_data_out(const osi3::SensorData& data)
 {
-    data.SerializeToString(currentOutputBuffer);
-    encode_pointer_to_integer(currentOutputBuffer->data(),integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX]);
-    integer_vars[FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX]=(fmi2Integer)currentOutputBuffer->length();
-    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX],currentOutputBuffer->data());
-    swap(currentOutputBuffer,lastOutputBuffer);
+    if (fmi_sensor_view_output_mode() == SENSORVIEW_OUTPUT_MODE_SPLICE && sensorViewIn.valid()) {
+        uint8_t header[16];
+        size_t header_size = fmi_sensor_view_in_splice_header(header);
+        char* target = sensorDataOut.serialize(data,header_size+sensorViewIn.size());
+        memcpy(target,header,header_size);
+        memcpy(target+header_size,sensorViewIn.data(),sensorViewIn.size());
+    } else {
+        sensorDataOut.serialize(data);
+    }
+    const char* buffer = sensorDataOut.publish();
+    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX],buffer);
 }
 
 void COSMPDummySensor::reset_fmi_sensor_data_out()
 {
-    integer_vars[FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX]=0;
+    sensorDataOut.reset();
 }
 
 void COSMPDummySensor::refresh_fmi_sensor_view_config_request()
@@ -177,6 +169,310 @@ void COSMPDummySensor::refresh_fmi_sensor_view_config_request()
     }
 }
 
+#ifdef USE_PROTOBUF_ARENA
+/*
+ * Arena Handling
+ */
+
+void COSMPDummySensor::reset_arena()
+{
+    /*
+     * The arena is backed by an initial block we own.  If the last step
+     * needed more space than that block provides, the block is regrown
+     * geometrically, so that steady-state steps are served entirely from
+     * it and Reset() does not need to hand any memory back to the heap.
+     */
+    if (arena != NULL && arena->SpaceAllocated() <= arena_block_size) {
+        arena->Reset();
+        return;
+    }
+
+    if (arena != NULL) {
+        size_t needed = (size_t)arena->SpaceAllocated();
+        delete arena;
+        delete[] arena_block;
+        while (arena_block_size < needed)
+            arena_block_size *= 2;
+        normal_log("OSMP","Growing message arena to %llu bytes",(unsigned long long)arena_block_size);
+    }
+
+    arena_block = new char[arena_block_size];
+    google::protobuf::ArenaOptions options;
+    options.initial_block = arena_block;
+    options.initial_block_size = arena_block_size;
+    arena = new google::protobuf::Arena(options);
+}
+#endif
+
+/*
+ * Spatial Index
+ */
+
+std::mutex SpatialIndex::shared_mutex;
+std::shared_ptr<const SpatialIndex> SpatialIndex::shared_index;
+
+std::shared_ptr<const SpatialIndex> SpatialIndex::acquire(const void* data, size_t size, const osi3::GroundTruth& gt)
+{
+    /*
+     * Instances fed the same step of the same source get the same input
+     * buffer, so buffer, size, timestamp and object count identify it.
+     * Sources may however reuse a buffer for different content of equal
+     * size and timestamp, so the positions the index is built from are
+     * hashed as well, which is cheap compared to building the index.
+     */
+    Key current;
+    current.data = data;
+    current.size = size;
+    current.seconds = gt.timestamp().seconds();
+    current.nanos = gt.timestamp().nanos();
+    current.objects = gt.moving_object_size();
+    current.positions = hash_positions(gt);
+
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    if (!shared_index || !(shared_index->key == current)) {
+        std::shared_ptr<SpatialIndex> index(new SpatialIndex(gt));
+        index->key = current;
+        shared_index = index;
+    }
+    return shared_index;
+}
+
+SpatialIndex::SpatialIndex(const osi3::GroundTruth& gt)
+{
+    int count = gt.moving_object_size();
+    cells = max(1,(int)sqrt((double)count));
+    min_x = min_y = 0.0;
+    max_x = max_y = 0.0;
+    for (int i = 0; i < count; i++) {
+        const osi3::Vector3d& position = gt.moving_object(i).base().position();
+        if (i == 0 || position.x() < min_x) min_x = position.x();
+        if (i == 0 || position.x() > max_x) max_x = position.x();
+        if (i == 0 || position.y() < min_y) min_y = position.y();
+        if (i == 0 || position.y() > max_y) max_y = position.y();
+    }
+    cell_size = max(max_x-min_x,max_y-min_y)/cells;
+    if (!(cell_size > 0.0))
+        cell_size = 1.0;
+
+    /* Counting sort of object indices by cell, keeping input order within cells */
+    vector<int> object_cell(count);
+    cell_start.assign(cells*cells+1,0);
+    for (int i = 0; i < count; i++) {
+        const osi3::Vector3d& position = gt.moving_object(i).base().position();
+        object_cell[i] = cell_of(position.y(),min_y)*cells + cell_of(position.x(),min_x);
+        cell_start[object_cell[i]+1]++;
+    }
+    for (int c = 0; c < cells*cells; c++)
+        cell_start[c+1] += cell_start[c];
+    entries.resize(count);
+    vector<int> fill(cell_start.begin(),cell_start.end()-1);
+    for (int i = 0; i < count; i++)
+        entries[fill[object_cell[i]]++] = i;
+}
+
+uint64_t SpatialIndex::hash_positions(const osi3::GroundTruth& gt)
+{
+    /* FNV-1a style hash over the bit patterns of the x/y positions */
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < gt.moving_object_size(); i++) {
+        const osi3::Vector3d& position = gt.moving_object(i).base().position();
+        double coordinates[2] = { position.x(), position.y() };
+        uint64_t bits[2];
+        memcpy(bits,coordinates,sizeof(bits));
+        for (int c = 0; c < 2; c++) {
+            hash ^= bits[c];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+int SpatialIndex::cell_of(double value, double min_value) const
+{
+    double cell = floor((value-min_value)/cell_size);
+    if (!(cell > 0.0))
+        return 0;
+    if (cell >= cells)
+        return cells-1;
+    return (int)cell;
+}
+
+void SpatialIndex::query(double x, double y, double range, vector<int>& result) const
+{
+    result.clear();
+    /* Pad the range slightly, candidates are tested exactly by the caller */
+    double padded = range*(1.0+1e-6)+1e-6;
+    if (x+padded < min_x || x-padded > max_x || y+padded < min_y || y-padded > max_y)
+        return;
+    int x0 = cell_of(x-padded,min_x), x1 = cell_of(x+padded,min_x);
+    int y0 = cell_of(y-padded,min_y), y1 = cell_of(y+padded,min_y);
+    for (int cy = y0; cy <= y1; cy++)
+        result.insert(result.end(),entries.begin()+cell_start[cy*cells+x0],entries.begin()+cell_start[cy*cells+x1+1]);
+    /* Keep the order of the input, which determines the output order */
+    sort(result.begin(),result.end());
+}
+
+/*
+ * Detection Kernel
+ */
+
+void DetectionBatch::extract(const osi3::GroundTruth& gt, const vector<int>& indices, double ego_x, double ego_y, double ego_z)
+{
+    size = indices.size();
+    x.resize(size); y.resize(size); z.resize(size);
+    cos_yaw.resize(size); sin_yaw.resize(size);
+    cos_pitch.resize(size); sin_pitch.resize(size);
+    cos_roll.resize(size); sin_roll.resize(size);
+    rel_x.resize(size); rel_y.resize(size); rel_z.resize(size);
+    distance.resize(size);
+    detected.resize(size);
+    for (size_t k = 0; k < size; k++) {
+        const osi3::BaseMoving& base = gt.moving_object(indices[k]).base();
+        x[k] = base.position().x()-ego_x;
+        y[k] = base.position().y()-ego_y;
+        z[k] = base.position().z()-ego_z;
+        cos_yaw[k] = cos(base.orientation().yaw());
+        sin_yaw[k] = sin(base.orientation().yaw());
+        cos_pitch[k] = cos(base.orientation().pitch());
+        sin_pitch[k] = sin(base.orientation().pitch());
+        cos_roll[k] = cos(base.orientation().roll());
+        sin_roll[k] = sin(base.orientation().roll());
+    }
+}
+
+void DetectionBatch::transform_and_test_scalar(size_t k, double range)
+{
+    double m00 = cos_yaw[k]*cos_pitch[k], m01 = cos_yaw[k]*sin_pitch[k]*sin_roll[k] - sin_yaw[k]*cos_roll[k], m02 = cos_yaw[k]*sin_pitch[k]*cos_roll[k] + sin_yaw[k]*sin_roll[k];
+    double m10 = sin_yaw[k]*cos_pitch[k], m11 = sin_yaw[k]*sin_pitch[k]*sin_roll[k] + cos_yaw[k]*cos_roll[k], m12 = sin_yaw[k]*sin_pitch[k]*cos_roll[k] - cos_yaw[k]*sin_roll[k];
+    double m20 = -sin_pitch[k],          m21 = cos_pitch[k]*sin_roll[k],                                   m22 = cos_pitch[k]*cos_roll[k];
+
+    rel_x[k] = m00 * x[k] + m01 * y[k] + m02 * z[k];
+    rel_y[k] = m10 * x[k] + m11 * y[k] + m12 * z[k];
+    rel_z[k] = m20 * x[k] + m21 * y[k] + m22 * z[k];
+    distance[k] = sqrt(rel_x[k]*rel_x[k] + rel_y[k]*rel_y[k] + rel_z[k]*rel_z[k]);
+    detected[k] = (distance[k] <= range) && (rel_x[k]/distance[k] > 0.866025);
+}
+
+void DetectionBatch::transform_and_test(double range)
+{
+    size_t k = 0;
+#if defined(OSMP_USE_AVX2)
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d vrange = _mm256_set1_pd(range);
+    const __m256d vcone = _mm256_set1_pd(0.866025);
+    for (; k+4 <= size; k += 4) {
+        __m256d cy = _mm256_loadu_pd(&cos_yaw[k]), sy = _mm256_loadu_pd(&sin_yaw[k]);
+        __m256d cp = _mm256_loadu_pd(&cos_pitch[k]), sp = _mm256_loadu_pd(&sin_pitch[k]);
+        __m256d cr = _mm256_loadu_pd(&cos_roll[k]), sr = _mm256_loadu_pd(&sin_roll[k]);
+        __m256d vx = _mm256_loadu_pd(&x[k]), vy = _mm256_loadu_pd(&y[k]), vz = _mm256_loadu_pd(&z[k]);
+        __m256d cysp = _mm256_mul_pd(cy,sp), sysp = _mm256_mul_pd(sy,sp);
+        __m256d m00 = _mm256_mul_pd(cy,cp);
+        __m256d m01 = _mm256_sub_pd(_mm256_mul_pd(cysp,sr),_mm256_mul_pd(sy,cr));
+        __m256d m02 = _mm256_add_pd(_mm256_mul_pd(cysp,cr),_mm256_mul_pd(sy,sr));
+        __m256d m10 = _mm256_mul_pd(sy,cp);
+        __m256d m11 = _mm256_add_pd(_mm256_mul_pd(sysp,sr),_mm256_mul_pd(cy,cr));
+        __m256d m12 = _mm256_sub_pd(_mm256_mul_pd(sysp,cr),_mm256_mul_pd(cy,sr));
+        __m256d m20 = _mm256_xor_pd(sp,sign);
+        __m256d m21 = _mm256_mul_pd(cp,sr);
+        __m256d m22 = _mm256_mul_pd(cp,cr);
+        __m256d rx = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m00,vx),_mm256_mul_pd(m01,vy)),_mm256_mul_pd(m02,vz));
+        __m256d ry = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m10,vx),_mm256_mul_pd(m11,vy)),_mm256_mul_pd(m12,vz));
+        __m256d rz = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m20,vx),_mm256_mul_pd(m21,vy)),_mm256_mul_pd(m22,vz));
+        __m256d dist = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rx,rx),_mm256_mul_pd(ry,ry)),_mm256_mul_pd(rz,rz)));
+        __m256d inside = _mm256_and_pd(_mm256_cmp_pd(dist,vrange,_CMP_LE_OQ),_mm256_cmp_pd(_mm256_div_pd(rx,dist),vcone,_CMP_GT_OQ));
+        _mm256_storeu_pd(&rel_x[k],rx);
+        _mm256_storeu_pd(&rel_y[k],ry);
+        _mm256_storeu_pd(&rel_z[k],rz);
+        _mm256_storeu_pd(&distance[k],dist);
+        int mask = _mm256_movemask_pd(inside);
+        for (int l = 0; l < 4; l++)
+            detected[k+l] = (mask >> l) & 1;
+    }
+#elif defined(OSMP_USE_SSE2)
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d vrange = _mm_set1_pd(range);
+    const __m128d vcone = _mm_set1_pd(0.866025);
+    for (; k+2 <= size; k += 2) {
+        __m128d cy = _mm_loadu_pd(&cos_yaw[k]), sy = _mm_loadu_pd(&sin_yaw[k]);
+        __m128d cp = _mm_loadu_pd(&cos_pitch[k]), sp = _mm_loadu_pd(&sin_pitch[k]);
+        __m128d cr = _mm_loadu_pd(&cos_roll[k]), sr = _mm_loadu_pd(&sin_roll[k]);
+        __m128d vx = _mm_loadu_pd(&x[k]), vy = _mm_loadu_pd(&y[k]), vz = _mm_loadu_pd(&z[k]);
+        __m128d cysp = _mm_mul_pd(cy,sp), sysp = _mm_mul_pd(sy,sp);
+        __m128d m00 = _mm_mul_pd(cy,cp);
+        __m128d m01 = _mm_sub_pd(_mm_mul_pd(cysp,sr),_mm_mul_pd(sy,cr));
+        __m128d m02 = _mm_add_pd(_mm_mul_pd(cysp,cr),_mm_mul_pd(sy,sr));
+        __m128d m10 = _mm_mul_pd(sy,cp);
+        __m128d m11 = _mm_add_pd(_mm_mul_pd(sysp,sr),_mm_mul_pd(cy,cr));
+        __m128d m12 = _mm_sub_pd(_mm_mul_pd(sysp,cr),_mm_mul_pd(cy,sr));
+        __m128d m20 = _mm_xor_pd(sp,sign);
+        __m128d m21 = _mm_mul_pd(cp,sr);
+        __m128d m22 = _mm_mul_pd(cp,cr);
+        __m128d rx = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m00,vx),_mm_mul_pd(m01,vy)),_mm_mul_pd(m02,vz));
+        __m128d ry = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m10,vx),_mm_mul_pd(m11,vy)),_mm_mul_pd(m12,vz));
+        __m128d rz = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m20,vx),_mm_mul_pd(m21,vy)),_mm_mul_pd(m22,vz));
+        __m128d dist = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(rx,rx),_mm_mul_pd(ry,ry)),_mm_mul_pd(rz,rz)));
+        __m128d inside = _mm_and_pd(_mm_cmple_pd(dist,vrange),_mm_cmpgt_pd(_mm_div_pd(rx,dist),vcone));
+        _mm_storeu_pd(&rel_x[k],rx);
+        _mm_storeu_pd(&rel_y[k],ry);
+        _mm_storeu_pd(&rel_z[k],rz);
+        _mm_storeu_pd(&distance[k],dist);
+        int mask = _mm_movemask_pd(inside);
+        detected[k] = mask & 1;
+        detected[k+1] = (mask >> 1) & 1;
+    }
+#endif
+    for (; k < size; k++)
+        transform_and_test_scalar(k,range);
+}
+
+/*
+ * Object Lookup
+ */
+
+void COSMPDummySensor::refresh_object_index(const osi3::GroundTruth& gt)
+{
+    /*
+     * Object ids rarely change between steps, so the id to index map is
+     * only rebuilt if they differ from the ids of the last step.
+     */
+    int count = gt.moving_object_size();
+    bool changed = objectIds.size() != (size_t)count;
+    for (int i = 0; i < count && !changed; i++)
+        changed = objectIds[i] != gt.moving_object(i).id().value();
+    if (!changed)
+        return;
+
+    objectIds.resize(count);
+    objectIndex.clear();
+    for (int i = 0; i < count; i++) {
+        objectIds[i] = gt.moving_object(i).id().value();
+        objectIndex[objectIds[i]] = i;
+    }
+    /* Objects that disappeared lose their tracking ids */
+    for (unordered_map<uint64_t,uint64_t>::iterator it = trackingIds.begin(); it != trackingIds.end();) {
+        if (objectIndex.count(it->first))
+            ++it;
+        else
+            it = trackingIds.erase(it);
+    }
+    normal_log("OSI","Rebuilt index of %d moving object ids",count);
+}
+
+int COSMPDummySensor::find_object(uint64_t id) const
+{
+    unordered_map<uint64_t,int>::const_iterator it = objectIndex.find(id);
+    return it != objectIndex.end() ? it->second : -1;
+}
+
+uint64_t COSMPDummySensor::tracking_id(uint64_t id)
+{
+    unordered_map<uint64_t,uint64_t>::iterator it = trackingIds.find(id);
+    if (it != trackingIds.end())
+        return it->second;
+    trackingIds[id] = nextTrackingId;
+    return nextTrackingId++;
+}
+
 /*
  * Actual Core Content
  */
@@ -202,6 +498,33 @@ fmi2Status COSMPDummySensor::doInit()
         string_vars[i] = "";
 
     set_fmi_nominal_range(135.0);
+    set_fmi_sensor_view_output_mode(SENSORVIEW_OUTPUT_MODE_COPY);
+
+    objectIds.clear();
+    objectIndex.clear();
+    trackingIds.clear();
+    nextTrackingId = 0;
+
+    /* Only decode the parts of the SensorView input used in doCalc */
+    movingObjectInMask = FieldMask(osi3::MovingObject::descriptor())
+        .decode_field(osi3::MovingObject::kIdFieldNumber)
+        .decode_field(osi3::MovingObject::kBaseFieldNumber)
+        .decode_field(osi3::MovingObject::kTypeFieldNumber)
+        .decode_field(osi3::MovingObject::kVehicleClassificationFieldNumber);
+    groundTruthInMask = FieldMask(osi3::GroundTruth::descriptor())
+        .decode_field(osi3::GroundTruth::kVersionFieldNumber)
+        .decode_field(osi3::GroundTruth::kTimestampFieldNumber)
+        .decode_field(osi3::GroundTruth::kHostVehicleIdFieldNumber)
+        .decode_field_selectively(osi3::GroundTruth::kMovingObjectFieldNumber,&movingObjectInMask);
+    sensorViewInMask = FieldMask(osi3::SensorView::descriptor())
+        .decode_field(osi3::SensorView::kVersionFieldNumber)
+        .decode_field(osi3::SensorView::kTimestampFieldNumber)
+        .decode_field(osi3::SensorView::kSensorIdFieldNumber)
+        .decode_field(osi3::SensorView::kMountingPositionFieldNumber)
+        .decode_field(osi3::SensorView::kMountingPositionRmseFieldNumber)
+        .decode_field(osi3::SensorView::kHostVehicleIdFieldNumber)
+        .decode_field_selectively(osi3::SensorView::kGlobalGroundTruthFieldNumber,&groundTruthInMask);
+
     return fmi2OK;
 }
 
@@ -223,6 +546,11 @@ fmi2Status COSMPDummySensor::doExitInitializationMode()
 {
     DEBUGBREAK();
 
+    if (fmi_sensor_view_output_mode() < SENSORVIEW_OUTPUT_MODE_COPY || fmi_sensor_view_output_mode() > SENSORVIEW_OUTPUT_MODE_SPLICE) {
+        normal_log("OSI","Invalid SensorView output mode %d",fmi_sensor_view_output_mode());
+        return fmi2Error;
+    }
+
     osi3::SensorViewConfiguration config;
     if (!get_fmi_sensor_view_config(config))
         normal_log("OSI","Received no valid SensorViewConfiguration from Simulation Environment, assuming everything checks out.");
@@ -259,24 +587,29 @@ fmi2Status COSMPDummySensor::doCalc(fmi2Real currentCommunicationPoint, fmi2Real
 {
     DEBUGBREAK();
 
-    osi3::SensorView currentIn;
+#ifdef USE_PROTOBUF_ARENA
+    reset_arena();
+    osi3::SensorView& currentIn = *google::protobuf::Arena::CreateMessage<osi3::SensorView>(arena);
+    osi3::SensorData& currentOut = *google::protobuf::Arena::CreateMessage<osi3::SensorData>(arena);
+#else
+    osi3::SensorView& currentIn = sensorViewIn.message();
     osi3::SensorData currentOut;
+#endif
     double time = currentCommunicationPoint+communicationStepSize;
     normal_log("OSI","Calculating Sensor at %f for %f (step size %f)",currentCommunicationPoint,time,communicationStepSize);
     if (get_fmi_sensor_view_in(currentIn)) {
         double ego_x=0, ego_y=0, ego_z=0;
         osi3::Identifier ego_id = currentIn.global_ground_truth().host_vehicle_id();
         normal_log("OSI","Looking for EgoVehicle with ID: %llu",ego_id.value());
-        for_each(currentIn.global_ground_truth().moving_object().begin(),currentIn.global_ground_truth().moving_object().end(),
-            [this, ego_id, &ego_x, &ego_y, &ego_z](const osi3::MovingObject& obj) {
-                normal_log("OSI","MovingObject with ID %llu is EgoVehicle: %d",obj.id().value(), obj.id().value() == ego_id.value());
-                if (obj.id().value() == ego_id.value()) {
-                    normal_log("OSI","Found EgoVehicle with ID: %llu",obj.id().value());
-                    ego_x = obj.base().position().x();
-                    ego_y = obj.base().position().y();
-                    ego_z = obj.base().position().z();
-                }
-            });
+        refresh_object_index(currentIn.global_ground_truth());
+        int ego_index = find_object(ego_id.value());
+        if (ego_index >= 0) {
+            const osi3::MovingObject& obj = currentIn.global_ground_truth().moving_object(ego_index);
+            normal_log("OSI","Found EgoVehicle with ID: %llu",obj.id().value());
+            ego_x = obj.base().position().x();
+            ego_y = obj.base().position().y();
+            ego_z = obj.base().position().z();
+        }
         normal_log("OSI","Current Ego Position: %f,%f,%f", ego_x, ego_y, ego_z);
 
         /* Clear Output */
@@ -285,53 +618,88 @@ fmi2Status COSMPDummySensor::doCalc(fmi2Real currentCommunicationPoint, fmi2Real
         /* Adjust Timestamps and Ids */
         currentOut.mutable_timestamp()->set_seconds((long long int)floor(time));
         currentOut.mutable_timestamp()->set_nanos((int)((time - floor(time))*1000000000.0));
-        /* Copy of SensorView */
-        currentOut.add_sensor_view()->CopyFrom(currentIn);
+        /* SensorView (spliced in verbatim on serialization if requested) */
+        if (fmi_sensor_view_output_mode() == SENSORVIEW_OUTPUT_MODE_COPY) {
+            currentOut.add_sensor_view()->CopyFrom(currentIn);
+        } else if (fmi_sensor_view_output_mode() == SENSORVIEW_OUTPUT_MODE_HEADER) {
+            osi3::SensorView* view = currentOut.add_sensor_view();
+            if (currentIn.has_version())
+                view->mutable_version()->CopyFrom(currentIn.version());
+            if (currentIn.has_timestamp())
+                view->mutable_timestamp()->CopyFrom(currentIn.timestamp());
+            if (currentIn.has_sensor_id())
+                view->mutable_sensor_id()->CopyFrom(currentIn.sensor_id());
+            if (currentIn.has_mounting_position())
+                view->mutable_mounting_position()->CopyFrom(currentIn.mounting_position());
+            if (currentIn.has_mounting_position_rmse())
+                view->mutable_mounting_position_rmse()->CopyFrom(currentIn.mounting_position_rmse());
+            if (currentIn.has_host_vehicle_id())
+                view->mutable_host_vehicle_id()->CopyFrom(currentIn.host_vehicle_id());
+        }
 
         int i=0;
         double actual_range = fmi_nominal_range()*1.1;
-        for_each(currentIn.global_ground_truth().moving_object().begin(),currentIn.global_ground_truth().moving_object().end(),
-            [this,&i,&currentIn,&currentOut,ego_id,ego_x,ego_y,ego_z,actual_range](const osi3::MovingObject& veh) {
-                if (veh.id().value() != ego_id.value()) {
-                    // NOTE: We currently do not take sensor mounting position into account,
-                    // i.e. sensor-relative coordinates are relative to center of bounding box
-                    // of ego vehicle currently.
-                    double trans_x = veh.base().position().x()-ego_x;
-                    double trans_y = veh.base().position().y()-ego_y;
-                    double trans_z = veh.base().position().z()-ego_z;
-                    double rel_x,rel_y,rel_z;
-                    rotatePoint(trans_x,trans_y,trans_z,veh.base().orientation().yaw(),veh.base().orientation().pitch(),veh.base().orientation().roll(),rel_x,rel_y,rel_z);
-                    double distance = sqrt(rel_x*rel_x + rel_y*rel_y + rel_z*rel_z);
-                    if ((distance <= actual_range) && (rel_x/distance > 0.866025)) {
-                        osi3::DetectedMovingObject *obj = currentOut.mutable_moving_object()->Add();
-                        obj->mutable_header()->add_ground_truth_id()->CopyFrom(veh.id());
-                        obj->mutable_header()->mutable_tracking_id()->set_value(i);
-                        obj->mutable_header()->set_existence_probability(cos((2.0*distance-actual_range)/actual_range));
-                        obj->mutable_header()->set_measurement_state(osi3::DetectedItemHeader_MeasurementState_MEASUREMENT_STATE_MEASURED);
-                        obj->mutable_header()->add_sensor_id()->CopyFrom(currentIn.sensor_id());
-                        obj->mutable_base()->mutable_position()->set_x(rel_x);
-                        obj->mutable_base()->mutable_position()->set_y(rel_y);
-                        obj->mutable_base()->mutable_position()->set_z(rel_z);
-                        obj->mutable_base()->mutable_dimension()->set_length(veh.base().dimension().length());
-                        obj->mutable_base()->mutable_dimension()->set_width(veh.base().dimension().width());
-                        obj->mutable_base()->mutable_dimension()->set_height(veh.base().dimension().height());
-                        
-                        osi3::DetectedMovingObject::CandidateMovingObject* candidate = obj->add_candidate();
-                        candidate->set_type(veh.type());
-                        candidate->mutable_vehicle_classification()->CopyFrom(veh.vehicle_classification());
-                        candidate->set_probability(1);
-                        
-                        normal_log("OSI","Output Vehicle %d[%llu] Probability %f Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),obj->header().existence_probability(),rel_x,rel_y,rel_z,obj->base().position().x(),obj->base().position().y(),obj->base().position().z());
-                        i++;
-                    } else {
-                        normal_log("OSI","Ignoring Vehicle %d[%llu] Outside Sensor Scope Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),veh.base().position().x()-ego_x,veh.base().position().y()-ego_y,veh.base().position().z()-ego_z,veh.base().position().x(),veh.base().position().y(),veh.base().position().z());
-                    }
-                }
-                else
-                {
-                    normal_log("OSI","Ignoring EGO Vehicle %d[%llu] Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),veh.base().position().x()-ego_x,veh.base().position().y()-ego_y,veh.base().position().z()-ego_z,veh.base().position().x(),veh.base().position().y(),veh.base().position().z());
+        const osi3::GroundTruth& gt = currentIn.global_ground_truth();
+        if (fmi_spatial_index()) {
+            /* Only vehicles in grid cells around the ego vehicle can be within range */
+            std::shared_ptr<const SpatialIndex> index = SpatialIndex::acquire(sensorViewIn.data(),sensorViewIn.size(),gt);
+            index->query(ego_x,ego_y,actual_range,candidates);
+            normal_log("OSI","Spatial index yields %d of %d vehicles as candidates",(int)candidates.size(),gt.moving_object_size());
+        } else {
+            candidates.resize(gt.moving_object_size());
+            for (int j = 0; j < gt.moving_object_size(); j++)
+                candidates[j] = j;
+        }
+        // NOTE: We currently do not take sensor mounting position into account,
+        // i.e. sensor-relative coordinates are relative to center of bounding box
+        // of ego vehicle currently.
+        detectionBatch.extract(gt,candidates,ego_x,ego_y,ego_z);
+        detectionBatch.transform_and_test(actual_range);
+        for (size_t k = 0; k < candidates.size(); k++) {
+            const osi3::MovingObject& veh = gt.moving_object(candidates[k]);
+            if (veh.id().value() != ego_id.value()) {
+                double rel_x = detectionBatch.rel_x[k];
+                double rel_y = detectionBatch.rel_y[k];
+                double rel_z = detectionBatch.rel_z[k];
+                double distance = detectionBatch.distance[k];
+#ifdef CHECK_DETECTION_KERNEL
+                double ref_x,ref_y,ref_z;
+                rotatePoint(detectionBatch.x[k],detectionBatch.y[k],detectionBatch.z[k],veh.base().orientation().yaw(),veh.base().orientation().pitch(),veh.base().orientation().roll(),ref_x,ref_y,ref_z);
+                double ref_distance = sqrt(ref_x*ref_x + ref_y*ref_y + ref_z*ref_z);
+                bool ref_detected = (ref_distance <= actual_range) && (ref_x/ref_distance > 0.866025);
+                if (memcmp(&ref_x,&rel_x,sizeof(double)) || memcmp(&ref_y,&rel_y,sizeof(double)) || memcmp(&ref_z,&rel_z,sizeof(double)) || memcmp(&ref_distance,&distance,sizeof(double)) || ref_detected != !!detectionBatch.detected[k])
+                    normal_log("OSMP","Detection kernel mismatch for Vehicle [%llu]: %.17g,%.17g,%.17g (%.17g) vs. reference %.17g,%.17g,%.17g (%.17g)",veh.id().value(),rel_x,rel_y,rel_z,distance,ref_x,ref_y,ref_z,ref_distance);
+#endif
+                if (detectionBatch.detected[k]) {
+                    osi3::DetectedMovingObject *obj = currentOut.mutable_moving_object()->Add();
+                    obj->mutable_header()->add_ground_truth_id()->CopyFrom(veh.id());
+                    obj->mutable_header()->mutable_tracking_id()->set_value(tracking_id(veh.id().value()));
+                    obj->mutable_header()->set_existence_probability(cos((2.0*distance-actual_range)/actual_range));
+                    obj->mutable_header()->set_measurement_state(osi3::DetectedItemHeader_MeasurementState_MEASUREMENT_STATE_MEASURED);
+                    obj->mutable_header()->add_sensor_id()->CopyFrom(currentIn.sensor_id());
+                    obj->mutable_base()->mutable_position()->set_x(rel_x);
+                    obj->mutable_base()->mutable_position()->set_y(rel_y);
+                    obj->mutable_base()->mutable_position()->set_z(rel_z);
+                    obj->mutable_base()->mutable_dimension()->set_length(veh.base().dimension().length());
+                    obj->mutable_base()->mutable_dimension()->set_width(veh.base().dimension().width());
+                    obj->mutable_base()->mutable_dimension()->set_height(veh.base().dimension().height());
+                    
+                    osi3::DetectedMovingObject::CandidateMovingObject* candidate = obj->add_candidate();
+                    candidate->set_type(veh.type());
+                    candidate->mutable_vehicle_classification()->CopyFrom(veh.vehicle_classification());
+                    candidate->set_probability(1);
+                    
+                    normal_log("OSI","Output Vehicle %d[%llu] Probability %f Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),obj->header().existence_probability(),rel_x,rel_y,rel_z,obj->base().position().x(),obj->base().position().y(),obj->base().position().z());
+                    i++;
+                } else {
+                    normal_log("OSI","Ignoring Vehicle %d[%llu] Outside Sensor Scope Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),veh.base().position().x()-ego_x,veh.base().position().y()-ego_y,veh.base().position().z()-ego_z,veh.base().position().x(),veh.base().position().y(),veh.base().position().z());
                 }
-            });
+            }
+            else
+            {
+                normal_log("OSI","Ignoring EGO Vehicle %d[%llu] Relative Position: %f,%f,%f (%f,%f,%f)",i,veh.id().value(),veh.base().position().x()-ego_x,veh.base().position().y()-ego_y,veh.base().position().z()-ego_z,veh.base().position().x(),veh.base().position().y(),veh.base().position().z());
+            }
+        }
         normal_log("OSI","Mapped %d vehicles to output", i);
         /* Serialize */
         set_fmi_sensor_data_out(currentOut);
@@ -351,6 +719,8 @@ fmi2Status COSMPDummySensor::doTerm()
 {
     DEBUGBREAK();
 
+    normal_log("OSMP","Input message reuse saved allocation of %llu ground truth entries",reusedInputEntries);
+
     return fmi2OK;
 }
 
@@ -368,27 +738,40 @@ COSMPDummySensor::COSMPDummySensor(fmi2String theinstanceName, fmi2Type thefmuTy
     fmuType(thefmuType),
     fmuGUID(thefmuGUID),
     fmuResourceLocation(thefmuResourceLocation),
-    functions(*thefunctions),
     visible(!!thevisible),
     loggingOn(!!theloggingOn),
-    simulation_started(false)
+    functions(*thefunctions),
+    simulation_started(false),
+    sensorViewConfig(integer_vars),
+    sensorViewConfigRequest(integer_vars),
+    sensorViewIn(integer_vars),
+    sensorDataOut(integer_vars,65536),
+    sensorViewInMask(osi3::SensorView::descriptor()),
+    groundTruthInMask(osi3::GroundTruth::descriptor()),
+    movingObjectInMask(osi3::MovingObject::descriptor()),
+    reusedInputEntries(0)
 {
-    currentOutputBuffer=new string();
-    lastOutputBuffer=new string();
-    currentConfigRequestBuffer=new string();
-    lastConfigRequestBuffer=new string();
-    loggingCategories.clear();
-    loggingCategories.insert("FMI");
-    loggingCategories.insert("OSMP");
-    loggingCategories.insert("OSI");
+#ifdef USE_PROTOBUF_ARENA
+    arena=NULL;
+    arena_block=NULL;
+    arena_block_size=65536;
+    reset_arena();
+#endif
+    loggingCategories = LOG_CATEGORY_ALL;
+#ifdef PRIVATE_LOG_PATH
+    OSMPAsyncLogWriter::open(PRIVATE_LOG_PATH);
+#endif
 }
 
 COSMPDummySensor::~COSMPDummySensor()
 {
-    delete currentOutputBuffer;
-    delete lastOutputBuffer;
-    delete currentConfigRequestBuffer;
-    delete lastConfigRequestBuffer;
+#ifdef PRIVATE_LOG_PATH
+    OSMPAsyncLogWriter::close();
+#endif
+#ifdef USE_PROTOBUF_ARENA
+    delete arena;
+    delete[] arena_block;
+#endif
 }
 
 fmi2Status COSMPDummySensor::SetDebugLogging(fmi2Boolean theloggingOn, size_t nCategories, const fmi2String categories[])
@@ -396,20 +779,11 @@ fmi2Status COSMPDummySensor::SetDebugLogging(fmi2Boolean theloggingOn, size_t nC
     fmi_verbose_log("fmi2SetDebugLogging(%s)", theloggingOn ? "true" : "false");
     loggingOn = theloggingOn ? true : false;
     if (categories && (nCategories > 0)) {
-        loggingCategories.clear();
-        for (size_t i=0;i<nCategories;i++) {
-            if (0==strcmp(categories[i],"FMI"))
-                loggingCategories.insert("FMI");
-            else if (0==strcmp(categories[i],"OSMP"))
-                loggingCategories.insert("OSMP");
-            else if (0==strcmp(categories[i],"OSI"))
-                loggingCategories.insert("OSI");
-        }
+        loggingCategories = 0;
+        for (size_t i=0;i<nCategories;i++)
+            loggingCategories |= log_category(categories[i]);
     } else {
-        loggingCategories.clear();
-        loggingCategories.insert("FMI");
-        loggingCategories.insert("OSMP");
-        loggingCategories.insert("OSI");
+        loggingCategories = LOG_CATEGORY_ALL;
     }
     return fmi2OK;
 }
@@ -28,6 +28,17 @@ using namespace std;
  *   FMI calls is enabled, which can get very verbose.
  */
 
+/*
+ * Logging Categories
+ *
+ * Categories are kept as a bitmask, so that disabled log messages
+ * can be skipped before any formatting takes place.
+ */
+#define LOG_CATEGORY_FMI 0x1
+#define LOG_CATEGORY_OSMP 0x2
+#define LOG_CATEGORY_OSI 0x4
+#define LOG_CATEGORY_ALL (LOG_CATEGORY_FMI|LOG_CATEGORY_OSMP|LOG_CATEGORY_OSI)
+
 /*
  * Variable Definitions
  *
@@ -43,7 +54,8 @@ using namespace std;
 
 /* Boolean Variables */
 #define FMI_BOOLEAN_VALID_IDX 0
-#define FMI_BOOLEAN_LAST_IDX FMI_BOOLEAN_VALID_IDX
+#define FMI_BOOLEAN_SPATIAL_INDEX_IDX 1
+#define FMI_BOOLEAN_LAST_IDX FMI_BOOLEAN_SPATIAL_INDEX_IDX
 #define FMI_BOOLEAN_VARS (FMI_BOOLEAN_LAST_IDX+1)
 
 /* Integer Variables */
@@ -60,9 +72,16 @@ using namespace std;
 #define FMI_INTEGER_SENSORVIEW_CONFIG_BASEHI_IDX 10
 #define FMI_INTEGER_SENSORVIEW_CONFIG_SIZE_IDX 11
 #define FMI_INTEGER_COUNT_IDX 12
-#define FMI_INTEGER_LAST_IDX FMI_INTEGER_COUNT_IDX
+#define FMI_INTEGER_SENSORVIEW_OUTPUT_MODE_IDX 13
+#define FMI_INTEGER_LAST_IDX FMI_INTEGER_SENSORVIEW_OUTPUT_MODE_IDX
 #define FMI_INTEGER_VARS (FMI_INTEGER_LAST_IDX+1)
 
+/* Values of the sensorviewoutputmode parameter */
+#define SENSORVIEW_OUTPUT_MODE_COPY 0
+#define SENSORVIEW_OUTPUT_MODE_OMIT 1
+#define SENSORVIEW_OUTPUT_MODE_HEADER 2
+#define SENSORVIEW_OUTPUT_MODE_SPLICE 3
+
 /* Real Variables */
 #define FMI_REAL_NOMINAL_RANGE_IDX 0
 #define FMI_REAL_LAST_IDX FMI_REAL_NOMINAL_RANGE_IDX
@@ -76,12 +95,107 @@ using namespace std;
 #include <fstream>
 #include <string>
 #include <cstdarg>
-#include <set>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #undef min
 #undef max
 #include "osi_sensorview.pb.h"
 #include "osi_sensordata.pb.h"
+#include "OSMPBinaryVariable.h"
+#ifdef PRIVATE_LOG_PATH
+#include "OSMPAsyncLogWriter.h"
+#endif
+
+/*
+ * Arena Allocation
+ *
+ * If USE_PROTOBUF_ARENA is defined, the SensorView and SensorData
+ * messages of each step are allocated on a per-instance protobuf
+ * Arena, which is reset once per step.  This requires Protocol
+ * Buffers 3.x with arena support enabled for the OSI messages.
+ */
+#ifdef USE_PROTOBUF_ARENA
+#if GOOGLE_PROTOBUF_VERSION < 3000000
+#error "USE_PROTOBUF_ARENA requires Protocol Buffers 3.0.0 or later"
+#endif
+#include <google/protobuf/arena.h>
+#endif
+
+/*
+ * Spatial Index
+ *
+ * Uniform grid over the ground truth positions (x/y) of all moving
+ * objects of a SensorView, bucketing object indices into roughly
+ * sqrt(N) x sqrt(N) cells.  The index of the current step is built
+ * once and shared by all sensor instances in the process that see the
+ * same input, so range queries only touch the cells around the ego
+ * vehicle instead of testing every object.  Inputs are matched by
+ * buffer, size, timestamp and object count, and by a hash of the object
+ * positions, so a buffer that is reused for different content is never
+ * mistaken for the same input.
+ */
+class SpatialIndex {
+public:
+    /* Returns the index for the given input, building it unless it is already shared */
+    static std::shared_ptr<const SpatialIndex> acquire(const void* data, size_t size, const osi3::GroundTruth& gt);
+    /* Collects the indices of all objects possibly within range of (x,y), in ascending order */
+    void query(double x, double y, double range, std::vector<int>& result) const;
+
+protected:
+    explicit SpatialIndex(const osi3::GroundTruth& gt);
+    int cell_of(double value, double min_value) const;
+    static uint64_t hash_positions(const osi3::GroundTruth& gt);
+
+    struct Key {
+        const void* data;
+        size_t size;
+        long long seconds;
+        int nanos;
+        int objects;
+        uint64_t positions;
+        bool operator==(const Key& other) const { return data == other.data && size == other.size && seconds == other.seconds && nanos == other.nanos && objects == other.objects && positions == other.positions; }
+    };
+
+    Key key;
+    int cells;
+    double min_x, min_y, max_x, max_y, cell_size;
+    std::vector<int> cell_start;
+    std::vector<int> entries;
+
+    static std::mutex shared_mutex;
+    static std::shared_ptr<const SpatialIndex> shared_index;
+};
+
+/*
+ * Detection Kernel
+ *
+ * Structure-of-arrays batch of the vehicles to be tested in a step.
+ * The sine and cosine of each vehicle's orientation are extracted once,
+ * then the rotation into sensor coordinates, the distance and the field
+ * of view test run vectorized (AVX2, SSE2 or scalar, as available at
+ * compile time).  Operations are performed in the same order as in
+ * rotatePoint, so results are bit-identical to the scalar code as long
+ * as the compiler does not contract them into FMAs.
+ */
+class DetectionBatch {
+public:
+    void extract(const osi3::GroundTruth& gt, const std::vector<int>& indices, double ego_x, double ego_y, double ego_z);
+    void transform_and_test(double range);
+
+    size_t size;
+    std::vector<double> x, y, z;
+    std::vector<double> cos_yaw, sin_yaw, cos_pitch, sin_pitch, cos_roll, sin_roll;
+    std::vector<double> rel_x, rel_y, rel_z, distance;
+    std::vector<unsigned char> detected;
+
+protected:
+    void transform_and_test_scalar(size_t k, double range);
+};
 
 /* FMU Class */
 class COSMPDummySensor {
@@ -119,50 +233,77 @@ protected:
 
 protected:
     /* Private File-based Logging just for Debugging */
-#ifdef PRIVATE_LOG_PATH
-    static ofstream private_log_file;
-#endif
-
     static void fmi_verbose_log_global(const char* format, ...) {
 #ifdef VERBOSE_FMI_LOGGING
 #ifdef PRIVATE_LOG_PATH
         va_list ap;
         va_start(ap, format);
         char buffer[1024];
-        if (!private_log_file.is_open())
-            private_log_file.open(PRIVATE_LOG_PATH, ios::out | ios::app);
-        if (private_log_file.is_open()) {
 #ifdef _WIN32
-            vsnprintf_s(buffer, 1024, format, ap);
+        vsnprintf_s(buffer, 1024, _TRUNCATE, format, ap);
 #else
-            vsnprintf(buffer, 1024, format, ap);
+        vsnprintf(buffer, 1024, format, ap);
 #endif
-            private_log_file << "OSMPDummySensor" << "::Global:FMI: " << buffer << endl;
-            private_log_file.flush();
-        }
+        va_end(ap);
+        char line[1280];
+#ifdef _WIN32
+        int length = _snprintf_s(line, sizeof(line), _TRUNCATE, "OSMPDummySensor::Global:FMI: %s", buffer);
+#else
+        int length = snprintf(line, sizeof(line), "OSMPDummySensor::Global:FMI: %s", buffer);
+#endif
+        if (length < 0 || length >= (int)sizeof(line))
+            length = (int)strlen(line);
+        /* Also called before the first and after the last instance, when the line is written synchronously */
+        OSMPAsyncLogWriter::write_unopened(PRIVATE_LOG_PATH, line, (size_t)length);
 #endif
 #endif
     }
 
+    static unsigned int log_category(const char* category)
+    {
+        if (0==strcmp(category,"FMI"))
+            return LOG_CATEGORY_FMI;
+        else if (0==strcmp(category,"OSMP"))
+            return LOG_CATEGORY_OSMP;
+        else if (0==strcmp(category,"OSI"))
+            return LOG_CATEGORY_OSI;
+        return 0;
+    }
+
+    /* Checked before formatting:  Both the private log and the FMI logger honor loggingOn and the categories */
+    bool log_enabled(const char* category) const
+    {
+#if defined(PRIVATE_LOG_PATH)
+        return loggingOn && (loggingCategories & log_category(category)) != 0;
+#elif defined(PUBLIC_LOGGING)
+        return loggingOn && (loggingCategories & log_category(category)) != 0;
+#else
+        return false;
+#endif
+    }
+
     void internal_log(const char* category, const char* format, va_list arg)
     {
 #if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
         char buffer[1024];
 #ifdef _WIN32
-        vsnprintf_s(buffer, 1024, format, arg);
+        vsnprintf_s(buffer, 1024, _TRUNCATE, format, arg);
 #else
         vsnprintf(buffer, 1024, format, arg);
 #endif
 #ifdef PRIVATE_LOG_PATH
-        if (!private_log_file.is_open())
-            private_log_file.open(PRIVATE_LOG_PATH, ios::out | ios::app);
-        if (private_log_file.is_open()) {
-            private_log_file << "OSMPDummySensor" << "::" << instanceName << "<" << ((void*)this) << ">:" << category << ": " << buffer << endl;
-            private_log_file.flush();
-        }
+        char line[1280];
+#ifdef _WIN32
+        int length = _snprintf_s(line, sizeof(line), _TRUNCATE, "OSMPDummySensor::%s<%p>:%s: %s", instanceName.c_str(), (void*)this, category, buffer);
+#else
+        int length = snprintf(line, sizeof(line), "OSMPDummySensor::%s<%p>:%s: %s", instanceName.c_str(), (void*)this, category, buffer);
+#endif
+        if (length < 0 || length >= (int)sizeof(line))
+            length = (int)strlen(line);
+        OSMPAsyncLogWriter::write(line, (size_t)length);
 #endif
 #ifdef PUBLIC_LOGGING
-        if (loggingOn && loggingCategories.count(category))
+        if (loggingOn && (loggingCategories & log_category(category)))
             functions.logger(functions.componentEnvironment,instanceName.c_str(),fmi2OK,category,buffer);
 #endif
 #endif
@@ -170,6 +311,8 @@ protected:
 
     void fmi_verbose_log(const char* format, ...) {
 #if  defined(VERBOSE_FMI_LOGGING) && (defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING))
+        if (!log_enabled("FMI"))
+            return;
         va_list ap;
         va_start(ap, format);
         internal_log("FMI",format,ap);
@@ -180,6 +323,8 @@ protected:
     /* Normal Logging */
     void normal_log(const char* category, const char* format, ...) {
 #if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
+        if (!log_enabled(category))
+            return;
         va_list ap;
         va_start(ap, format);
         internal_log(category,format,ap);
@@ -195,23 +340,46 @@ protected:
     string fmuResourceLocation;
     bool visible;
     bool loggingOn;
-    set<string> loggingCategories;
+    unsigned int loggingCategories;
     fmi2CallbackFunctions functions;
     fmi2Boolean boolean_vars[FMI_BOOLEAN_VARS];
     fmi2Integer integer_vars[FMI_INTEGER_VARS];
     fmi2Real real_vars[FMI_REAL_VARS];
     string string_vars[FMI_STRING_VARS];
     bool simulation_started;
-    string* currentOutputBuffer;
-    string* lastOutputBuffer;
-    string* currentConfigRequestBuffer;
-    string* lastConfigRequestBuffer;
+    /* Binary Variables (the SensorView input is re-parsed into a long-lived message) */
+    OSMPBinaryInput<osi3::SensorViewConfiguration,FMI_INTEGER_SENSORVIEW_CONFIG_BASELO_IDX,FMI_INTEGER_SENSORVIEW_CONFIG_BASEHI_IDX,FMI_INTEGER_SENSORVIEW_CONFIG_SIZE_IDX> sensorViewConfig;
+    OSMPBinaryOutput<osi3::SensorViewConfiguration,FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASELO_IDX,FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_BASEHI_IDX,FMI_INTEGER_SENSORVIEW_CONFIG_REQUEST_SIZE_IDX> sensorViewConfigRequest;
+    OSMPBinaryInput<osi3::SensorView,FMI_INTEGER_SENSORVIEW_IN_BASELO_IDX,FMI_INTEGER_SENSORVIEW_IN_BASEHI_IDX,FMI_INTEGER_SENSORVIEW_IN_SIZE_IDX> sensorViewIn;
+    OSMPBinaryOutput<osi3::SensorData,FMI_INTEGER_SENSORDATA_OUT_BASELO_IDX,FMI_INTEGER_SENSORDATA_OUT_BASEHI_IDX,FMI_INTEGER_SENSORDATA_OUT_SIZE_IDX> sensorDataOut;
+    /* Parts of the input the model actually uses */
+    FieldMask sensorViewInMask;
+    FieldMask groundTruthInMask;
+    FieldMask movingObjectInMask;
+    unsigned long long reusedInputEntries;
+    std::vector<int> candidates;
+    DetectionBatch detectionBatch;
+    /* Ids of the moving objects of the last step, and their indices */
+    std::vector<uint64_t> objectIds;
+    std::unordered_map<uint64_t,int> objectIndex;
+    /* Tracking ids assigned to ground truth ids, kept while objects exist */
+    std::unordered_map<uint64_t,uint64_t> trackingIds;
+    uint64_t nextTrackingId;
+#ifdef USE_PROTOBUF_ARENA
+    google::protobuf::Arena* arena;
+    char* arena_block;
+    size_t arena_block_size;
+#endif
 
     /* Simple Accessors */
     fmi2Boolean fmi_valid() { return boolean_vars[FMI_BOOLEAN_VALID_IDX]; }
     void set_fmi_valid(fmi2Boolean value) { boolean_vars[FMI_BOOLEAN_VALID_IDX]=value; }
+    fmi2Boolean fmi_spatial_index() { return boolean_vars[FMI_BOOLEAN_SPATIAL_INDEX_IDX]; }
+    void set_fmi_spatial_index(fmi2Boolean value) { boolean_vars[FMI_BOOLEAN_SPATIAL_INDEX_IDX]=value; }
     fmi2Integer fmi_count() { return integer_vars[FMI_INTEGER_COUNT_IDX]; }
     void set_fmi_count(fmi2Integer value) { integer_vars[FMI_INTEGER_COUNT_IDX]=value; }
+    fmi2Integer fmi_sensor_view_output_mode() { return integer_vars[FMI_INTEGER_SENSORVIEW_OUTPUT_MODE_IDX]; }
+    void set_fmi_sensor_view_output_mode(fmi2Integer value) { integer_vars[FMI_INTEGER_SENSORVIEW_OUTPUT_MODE_IDX]=value; }
     fmi2Real fmi_nominal_range() { return real_vars[FMI_REAL_NOMINAL_RANGE_IDX]; }
     void set_fmi_nominal_range(fmi2Real value) { real_vars[FMI_REAL_NOMINAL_RANGE_IDX]=value; }
 
@@ -223,7 +391,18 @@ protected:
     bool get_fmi_sensor_view_in(osi3::SensorView& data);
     void set_fmi_sensor_data_out(const osi3::SensorData& data);
     void reset_fmi_sensor_data_out();
+    size_t fmi_sensor_view_in_splice_header(uint8_t* header);
 
     /* Refreshing of Calculated Parameters */
     void refresh_fmi_sensor_view_config_request();
+
+    /* Object Lookup */
+    void refresh_object_index(const osi3::GroundTruth& gt);
+    int find_object(uint64_t id) const;
+    uint64_t tracking_id(uint64_t id);
+
+#ifdef USE_PROTOBUF_ARENA
+    /* Arena Handling */
+    void reset_arena();
+#endif
 };
@@ -48,72 +48,751 @@
 #include <algorithm>
 #include <cstdint>
 #include <cmath>
+#include <random>
+#include <climits>
+#include <cctype>
+#include <cstdlib>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-#ifdef PRIVATE_LOG_PATH
-ofstream COSMPDummySource::private_log_file;
+/*
+ * ProtocolBuffer Accessors
+ */
+
+void COSMPDummySource::set_fmi_sensor_view_out(const osi3::SensorView& data)
+{
+    const char* buffer = sensorViewOut.set(data);
+    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX],buffer);
+}
+
+void COSMPDummySource::patch_fmi_sensor_view_out(double time)
+{
+    currentOutTemplate.write(sensorViewOut.prepare(currentOutTemplate.size()),time,traffic);
+    const char* buffer = sensorViewOut.publish();
+    normal_log("OSMP","Providing %08X %08X, patched at %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX],buffer);
+}
+
+void COSMPDummySource::map_fmi_sensor_view_out(const char* data, size_t size)
+{
+    set_binary_variable(integer_vars,FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX,FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX,FMI_INTEGER_SENSORVIEW_OUT_SIZE_IDX,data,(fmi2Integer)size);
+    normal_log("OSMP","Providing %08X %08X, mapped at %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX],data);
+}
+
+void COSMPDummySource::reset_fmi_sensor_view_out()
+{
+    sensorViewOut.reset();
+}
+
+/*
+ * Traffic Generator
+ */
+
+/* The built-in scenario used when no objectCount is given */
+static const double default_y_offsets[10] = { 3.0, 3.0, 3.0, 0.25, 0, -0.25, -3.0, -3.0, -3.0, -3.0 };
+static const double default_x_offsets[10] = { 0.0, 40.0, 100.0, 100.0, 0.0, 150.0, 5.0, 45.0, 85.0, 125.0 };
+static const double default_x_speeds[10] = { 29.0, 30.0, 31.0, 25.0, 26.0, 28.0, 20.0, 22.0, 22.5, 23.0 };
+static const osi3::MovingObject_VehicleClassification_Type default_veh_types[10] = {
+    osi3::MovingObject_VehicleClassification_Type_TYPE_MEDIUM_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_SMALL_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_COMPACT_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_DELIVERY_VAN,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_LUXURY_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_MEDIUM_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_COMPACT_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_SMALL_CAR,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_MOTORBIKE,
+    osi3::MovingObject_VehicleClassification_Type_TYPE_BUS };
+
+#define TRAFFIC_LANE_WIDTH 3.5
+#define TRAFFIC_SLOT_LENGTH 30.0
+#define TRAFFIC_WEAVE_AMPLITUDE 0.25
+#define TRAFFIC_MIN_RING_RADIUS 50.0
+
+#define TWO_PI 6.28318530717958647693
+#define HALF_PI 1.57079632679489661923
+
+/* Rounds to the nearest integer for |x| < 2^51 with plain additions, which vectorize unlike nearbyint */
+static inline double round_nearest(double x)
+{
+    const double magic = 6755399441055744.0;
+    return (x + magic) - magic;
+}
+
+/*
+ * Sine and cosine of n angles: Reduction by pi/2 in three parts
+ * and the minimax polynomials of Cephes on [-pi/4,pi/4], accurate to
+ * about one ulp for the angle ranges occurring here.  The quadrant is
+ * applied through selects instead of branches, so the loop vectorizes.
+ */
+static void sincos_batch(const double* angle, double* s, double* c, size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        double q = round_nearest(angle[k] * 0.63661977236758134308);
+        double r = ((angle[k] - q*1.57079632673412561417e+00) - q*6.07710050630396597660e-11) - q*2.02226624879595063154e-21;
+        double z = r*r;
+        double ps = r + r*z*(((((1.58962301576546568060e-10*z - 2.50507477628578072866e-8)*z + 2.75573136213857245213e-6)*z - 1.98412698295895385996e-4)*z + 8.33333333332211858878e-3)*z - 1.66666666666666307295e-1);
+        double pc = 1.0 - 0.5*z + z*z*(((((-1.13585365213876817300e-11*z + 2.08757008419747316778e-9)*z - 2.75573141792967388112e-7)*z + 2.48015872888517045348e-5)*z - 1.38888888888730564116e-3)*z + 4.16666666666665929218e-2);
+        int quadrant = (int)q;
+        double sv = (quadrant & 1) ? pc : ps;
+        double cv = (quadrant & 1) ? ps : pc;
+        s[k] = (quadrant & 2) ? -sv : sv;
+        c[k] = ((quadrant + 1) & 2) ? -cv : cv;
+    }
+}
+
+/* Uniform in [lo,hi) from the raw generator output, so that a seed gives the same traffic on every platform */
+static double uniform(mt19937& rng, double lo, double hi)
+{
+    return lo + (hi - lo) * (rng() / 4294967296.0);
+}
+
+void TrafficGenerator::resize(size_t count)
+{
+    size = count;
+    type.resize(size);
+    offset_x.resize(size); offset_y.resize(size); speed.resize(size);
+    angle.resize(size); sin_angle.resize(size); cos_angle.resize(size);
+    x.resize(size); y.resize(size);
+    vx.resize(size); vy.resize(size);
+    ax.resize(size); ay.resize(size);
+    yaw.resize(size); yaw_rate.resize(size);
+}
+
+void TrafficGenerator::setup_default()
+{
+    resize(10);
+    profile = MOTION_PROFILE_WEAVE;
+    ring_radius = 0.0;
+    exact_trigonometry = true;
+    for (size_t k = 0; k < size; k++) {
+        type[k] = default_veh_types[k];
+        offset_x[k] = default_x_offsets[k];
+        offset_y[k] = default_y_offsets[k];
+        speed[k] = default_x_speeds[k];
+        yaw_rate[k] = 0.0;
+    }
+}
+
+void TrafficGenerator::setup(size_t count, int lanes, unsigned int seed, int theprofile)
+{
+    mt19937 rng(seed);
+    size_t slots = (count + lanes - 1) / lanes;
+
+    resize(count);
+    profile = theprofile;
+    exact_trigonometry = false;
+    ring_radius = std::max(TRAFFIC_MIN_RING_RADIUS, slots * TRAFFIC_SLOT_LENGTH / TWO_PI);
+    for (size_t k = 0; k < size; k++) {
+        int lane = (int)(k % lanes);
+        size_t slot = k / lanes;
+        type[k] = default_veh_types[rng() % 10];
+        offset_x[k] = slot * TRAFFIC_SLOT_LENGTH + uniform(rng, 0.0, TRAFFIC_SLOT_LENGTH / 2.0);
+        if (profile == MOTION_PROFILE_RING)
+            offset_y[k] = lane * TRAFFIC_LANE_WIDTH;
+        else
+            offset_y[k] = ((lanes - 1) / 2.0 - lane) * TRAFFIC_LANE_WIDTH;
+        /* Faster lanes further left (outside on the ring), with some spread within a lane */
+        speed[k] = 20.0 + 3.0 * lane + uniform(rng, -1.0, 1.0);
+        yaw_rate[k] = (profile == MOTION_PROFILE_RING) ? speed[k] / (ring_radius + offset_y[k]) : 0.0;
+    }
+}
+
+void TrafficGenerator::evaluate(double time)
+{
+    switch (profile) {
+    case MOTION_PROFILE_STRAIGHT:
+        for (size_t k = 0; k < size; k++) {
+            x[k] = offset_x[k] + time*speed[k];
+            y[k] = offset_y[k];
+            vx[k] = speed[k];
+            vy[k] = 0.0;
+            ax[k] = 0.0;
+            ay[k] = 0.0;
+            yaw[k] = 0.0;
+        }
+        break;
+    case MOTION_PROFILE_RING:
+        for (size_t k = 0; k < size; k++)
+            angle[k] = (offset_x[k] + time*speed[k]) / (ring_radius + offset_y[k]);
+        sincos_batch(angle.data(), sin_angle.data(), cos_angle.data(), size);
+        for (size_t k = 0; k < size; k++) {
+            double radius = ring_radius + offset_y[k];
+            double centripetal = speed[k]*speed[k] / radius;
+            double heading = angle[k] + HALF_PI;
+            x[k] = radius * cos_angle[k];
+            y[k] = radius * sin_angle[k];
+            vx[k] = -speed[k] * sin_angle[k];
+            vy[k] = speed[k] * cos_angle[k];
+            ax[k] = -centripetal * cos_angle[k];
+            ay[k] = -centripetal * sin_angle[k];
+            yaw[k] = heading - TWO_PI * round_nearest(heading / TWO_PI);
+        }
+        break;
+    default:
+        for (size_t k = 0; k < size; k++)
+            angle[k] = time/speed[k];
+        if (exact_trigonometry) {
+            for (size_t k = 0; k < size; k++) {
+                sin_angle[k] = sin(angle[k]);
+                cos_angle[k] = cos(angle[k]);
+            }
+        } else {
+            sincos_batch(angle.data(), sin_angle.data(), cos_angle.data(), size);
+        }
+        for (size_t k = 0; k < size; k++) {
+            x[k] = offset_x[k] + time*speed[k];
+            y[k] = offset_y[k] + sin_angle[k]*TRAFFIC_WEAVE_AMPLITUDE;
+            vx[k] = speed[k];
+            vy[k] = cos_angle[k]*TRAFFIC_WEAVE_AMPLITUDE/speed[k];
+            ax[k] = 0.0;
+            ay[k] = -sin_angle[k]*TRAFFIC_WEAVE_AMPLITUDE/(speed[k]*speed[k]);
+            yaw[k] = 0.0;
+        }
+        break;
+    }
+}
+
+/*
+ * Serialized Template
+ */
+
+#define WIRETYPE_VARINT 0
+#define WIRETYPE_FIXED64 1
+#define WIRETYPE_LENGTH_DELIMITED 2
+#define WIRETYPE_FIXED32 5
+
+/* Padded lengths of the timestamp varints, enough for any int64 seconds and uint32 nanos */
+#define TEMPLATE_SECONDS_LENGTH 10
+#define TEMPLATE_NANOS_LENGTH 5
+
+static bool read_wire_varint(const char* data, size_t& pos, size_t end, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        unsigned char byte = (unsigned char)data[pos++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/* Reads the field at pos of a message ending at end, returning its tag and the offset and length of its payload */
+static bool next_wire_field(const char* data, size_t& pos, size_t end, uint64_t& tag, size_t& offset, size_t& length)
+{
+    uint64_t value;
+    if (!read_wire_varint(data,pos,end,tag))
+        return false;
+    switch (tag & 7) {
+    case WIRETYPE_VARINT:
+        offset = pos;
+        if (!read_wire_varint(data,pos,end,value))
+            return false;
+        length = pos - offset;
+        return true;
+    case WIRETYPE_FIXED64:
+        length = 8;
+        break;
+    case WIRETYPE_LENGTH_DELIMITED:
+        if (!read_wire_varint(data,pos,end,value))
+            return false;
+        length = (size_t)value;
+        break;
+    case WIRETYPE_FIXED32:
+        length = 4;
+        break;
+    default:
+        return false;
+    }
+    if (length > end - pos)
+        return false;
+    offset = pos;
+    pos += length;
+    return true;
+}
+
+/* Finds the only occurrence of a field with the given wire type in the message at [begin,end) */
+static bool find_wire_field(const char* data, size_t begin, size_t end, int number, int wire_type, size_t& offset, size_t& length)
+{
+    int found = 0;
+    size_t pos = begin;
+    while (pos < end) {
+        uint64_t tag;
+        size_t field_offset, field_length;
+        if (!next_wire_field(data,pos,end,tag,field_offset,field_length))
+            return false;
+        if ((int)(tag >> 3) == number && (int)(tag & 7) == wire_type) {
+            offset = field_offset;
+            length = field_length;
+            found++;
+        }
+    }
+    return found == 1;
+}
+
+/* Offsets of the x and y components of a Vector3d field of a BaseMoving */
+static bool find_vector_fields(const char* data, size_t base, size_t base_length, int number, size_t& x, size_t& y)
+{
+    size_t offset, length, dummy;
+    return find_wire_field(data,base,base+base_length,number,WIRETYPE_LENGTH_DELIMITED,offset,length) &&
+        find_wire_field(data,offset,offset+length,osi3::Vector3d::kXFieldNumber,WIRETYPE_FIXED64,x,dummy) &&
+        find_wire_field(data,offset,offset+length,osi3::Vector3d::kYFieldNumber,WIRETYPE_FIXED64,y,dummy);
+}
+
+static void append_wire_varint(string& data, uint64_t value)
+{
+    while (value >= 0x80) {
+        data += (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    data += (char)value;
+}
+
+/* Writes a varint zero-padded to the given length, which parsers accept like its shortest form */
+static void put_padded_varint(char* target, uint64_t value, int length)
+{
+    for (int i = 0; i < length-1; i++) {
+        target[i] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    target[length-1] = (char)(value & 0x7F);
+}
+
+/* Writes a double as fixed64, i.e. little-endian regardless of the host */
+static inline void put_fixed64(char* target, double value)
+{
+    uint64_t bits;
+    memcpy(&bits,&value,sizeof(bits));
+    for (int i = 0; i < 8; i++)
+        target[i] = (char)(bits >> (8*i));
+}
+
+/* Appends a Timestamp field with padded varints, returning the offsets of the seconds and nanos */
+static void append_template_timestamp(string& data, int number, size_t& seconds, size_t& nanos)
+{
+    string timestamp;
+    append_wire_varint(timestamp,(osi3::Timestamp::kSecondsFieldNumber << 3) | WIRETYPE_VARINT);
+    seconds = timestamp.size();
+    timestamp.append(TEMPLATE_SECONDS_LENGTH,'\0');
+    append_wire_varint(timestamp,(osi3::Timestamp::kNanosFieldNumber << 3) | WIRETYPE_VARINT);
+    nanos = timestamp.size();
+    timestamp.append(TEMPLATE_NANOS_LENGTH,'\0');
+
+    append_wire_varint(data,(number << 3) | WIRETYPE_LENGTH_DELIMITED);
+    append_wire_varint(data,timestamp.size());
+    seconds += data.size();
+    nanos += data.size();
+    data += timestamp;
+}
+
+bool SensorViewTemplate::build(const osi3::SensorView& view, size_t objects)
+{
+    clear();
+
+    /* The timestamps go into the trailer */
+    osi3::SensorView untimed(view);
+    untimed.clear_timestamp();
+    untimed.mutable_global_ground_truth()->clear_timestamp();
+    if (!untimed.SerializeToString(&bytes)) {
+        clear();
+        return false;
+    }
+
+    size_t gt, gt_length;
+    if (!find_wire_field(bytes.data(),0,bytes.size(),osi3::SensorView::kGlobalGroundTruthFieldNumber,WIRETYPE_LENGTH_DELIMITED,gt,gt_length)) {
+        clear();
+        return false;
+    }
+    x.resize(objects); y.resize(objects);
+    vx.resize(objects); vy.resize(objects);
+    ax.resize(objects); ay.resize(objects);
+    yaw.resize(objects);
+
+    /* Each moving object must hold exactly one of each patched field */
+    size_t pos = gt, end = gt + gt_length, k = 0;
+    while (pos < end) {
+        uint64_t tag;
+        size_t object, object_length;
+        if (!next_wire_field(bytes.data(),pos,end,tag,object,object_length)) {
+            clear();
+            return false;
+        }
+        if ((int)(tag >> 3) != osi3::GroundTruth::kMovingObjectFieldNumber || (tag & 7) != WIRETYPE_LENGTH_DELIMITED)
+            continue;
+        size_t base, base_length, orientation, orientation_length, dummy;
+        if (k >= objects ||
+            !find_wire_field(bytes.data(),object,object+object_length,osi3::MovingObject::kBaseFieldNumber,WIRETYPE_LENGTH_DELIMITED,base,base_length) ||
+            !find_vector_fields(bytes.data(),base,base_length,osi3::BaseMoving::kPositionFieldNumber,x[k],y[k]) ||
+            !find_vector_fields(bytes.data(),base,base_length,osi3::BaseMoving::kVelocityFieldNumber,vx[k],vy[k]) ||
+            !find_vector_fields(bytes.data(),base,base_length,osi3::BaseMoving::kAccelerationFieldNumber,ax[k],ay[k]) ||
+            !find_wire_field(bytes.data(),base,base+base_length,osi3::BaseMoving::kOrientationFieldNumber,WIRETYPE_LENGTH_DELIMITED,orientation,orientation_length) ||
+            !find_wire_field(bytes.data(),orientation,orientation+orientation_length,osi3::Orientation3d::kYawFieldNumber,WIRETYPE_FIXED64,yaw[k],dummy)) {
+            clear();
+            return false;
+        }
+        k++;
+    }
+    if (k != objects) {
+        clear();
+        return false;
+    }
+
+    /* Trailer: The SensorView timestamp, and the ground truth timestamp wrapped in a ground truth fragment */
+    append_template_timestamp(bytes,osi3::SensorView::kTimestampFieldNumber,view_seconds,view_nanos);
+    string gt_fragment;
+    append_template_timestamp(gt_fragment,osi3::GroundTruth::kTimestampFieldNumber,gt_seconds,gt_nanos);
+    append_wire_varint(bytes,(osi3::SensorView::kGlobalGroundTruthFieldNumber << 3) | WIRETYPE_LENGTH_DELIMITED);
+    append_wire_varint(bytes,gt_fragment.size());
+    gt_seconds += bytes.size();
+    gt_nanos += bytes.size();
+    bytes += gt_fragment;
+    return true;
+}
+
+void SensorViewTemplate::write(char* target, double time, const TrafficGenerator& traffic) const
+{
+    memcpy(target,bytes.data(),bytes.size());
+    for (size_t k = 0; k < x.size(); k++) {
+        put_fixed64(target+x[k],traffic.x[k]);
+        put_fixed64(target+y[k],traffic.y[k]);
+        put_fixed64(target+vx[k],traffic.vx[k]);
+        put_fixed64(target+vy[k],traffic.vy[k]);
+        put_fixed64(target+ax[k],traffic.ax[k]);
+        put_fixed64(target+ay[k],traffic.ay[k]);
+        put_fixed64(target+yaw[k],traffic.yaw[k]);
+    }
+    uint64_t seconds = (uint64_t)(long long int)floor(time);
+    uint64_t nanos = (uint32_t)(int)((time - floor(time))*1000000000.0);
+    put_padded_varint(target+view_seconds,seconds,TEMPLATE_SECONDS_LENGTH);
+    put_padded_varint(target+view_nanos,nanos,TEMPLATE_NANOS_LENGTH);
+    put_padded_varint(target+gt_seconds,seconds,TEMPLATE_SECONDS_LENGTH);
+    put_padded_varint(target+gt_nanos,nanos,TEMPLATE_NANOS_LENGTH);
+}
+
+void SensorViewTemplate::clear()
+{
+    bytes.clear();
+    x.clear(); y.clear();
+    vx.clear(); vy.clear();
+    ax.clear(); ay.clear();
+    yaw.clear();
+}
+
+/*
+ * Sharded Serialization
+ */
+
+void WorkerPool::start(int theshards)
+{
+    stop();
+    stopping = false;
+    for (int shard = 1; shard < theshards; shard++)
+        workers.push_back(std::thread(&WorkerPool::work,this,shard,generation));
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+}
+
+void WorkerPool::run(const std::function<void(int)>& thetask)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &thetask;
+        pending = (int)workers.size();
+        generation++;
+    }
+    wakeup.notify_all();
+    thetask(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending > 0)
+        finished.wait(lock);
+    task = NULL;
+}
+
+void WorkerPool::work(int shard, unsigned long long seen)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        while (!stopping && generation == seen)
+            wakeup.wait(lock);
+        if (stopping)
+            return;
+        seen = generation;
+        const std::function<void(int)>* current = task;
+        lock.unlock();
+        (*current)(shard);
+        lock.lock();
+        if (--pending == 0)
+            finished.notify_one();
+    }
+}
+
+/*
+ * Serializes the SensorView with the moving objects split into one
+ * contiguous shard per pool thread.  The rest of the message is
+ * serialized on its own first, then the shard sizes are computed in
+ * parallel, and each shard is serialized straight into its region of
+ * the output buffer.  The moving objects end up behind the other
+ * ground truth fields, which is valid wire format in any case and the
+ * canonical order as long as no higher-numbered fields are set.
+ */
+void COSMPDummySource::set_fmi_sensor_view_out_sharded(osi3::SensorView& data)
+{
+    using google::protobuf::io::CodedOutputStream;
+    osi3::GroundTruth* gt = data.mutable_global_ground_truth();
+    const int objects = gt->moving_object_size();
+    const int shards = serializationPool.shards();
+    const uint32_t tag = (osi3::GroundTruth::kMovingObjectFieldNumber << 3) | WIRETYPE_LENGTH_DELIMITED;
+
+    google::protobuf::RepeatedPtrField<osi3::MovingObject> moving;
+    gt->mutable_moving_object()->Swap(&moving);
+    data.SerializeToString(&shardedHeader);
+    gt->mutable_moving_object()->Swap(&moving);
+    size_t gt_offset, gt_length;
+    if (!find_wire_field(shardedHeader.data(),0,shardedHeader.size(),osi3::SensorView::kGlobalGroundTruthFieldNumber,WIRETYPE_LENGTH_DELIMITED,gt_offset,gt_length)) {
+        set_fmi_sensor_view_out(data);
+        return;
+    }
+
+    /* Shard sizes, which also caches the sizes of all objects for serialization */
+    shardOffsets.assign(shards+1,0);
+    serializationPool.run([&](int shard) {
+        size_t size = 0;
+        for (int i = objects*shard/shards; i < objects*(shard+1)/shards; i++) {
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+            size_t length = gt->moving_object(i).ByteSizeLong();
+#else
+            size_t length = gt->moving_object(i).ByteSize();
 #endif
+            size += CodedOutputStream::VarintSize32(tag) + CodedOutputStream::VarintSize32((uint32_t)length) + length;
+        }
+        shardOffsets[shard+1] = size;
+    });
+    for (int shard = 0; shard < shards; shard++)
+        shardOffsets[shard+1] += shardOffsets[shard];
+    size_t objects_size = shardOffsets[shards];
+
+    /* Header with the enlarged ground truth length, the objects go between its ground truth and what follows it */
+    size_t prefix = gt_offset - CodedOutputStream::VarintSize64(gt_length);
+    size_t suffix = shardedHeader.size() - gt_offset - gt_length;
+    size_t total = prefix + CodedOutputStream::VarintSize64(gt_length+objects_size) + gt_length + objects_size + suffix;
+    uint8_t* target = reinterpret_cast<uint8_t*>(sensorViewOut.prepare(total));
+    memcpy(target,shardedHeader.data(),prefix);
+    uint8_t* gt_target = CodedOutputStream::WriteVarint64ToArray(gt_length+objects_size,target+prefix);
+    memcpy(gt_target,shardedHeader.data()+gt_offset,gt_length);
+    uint8_t* objects_target = gt_target + gt_length;
+    memcpy(objects_target+objects_size,shardedHeader.data()+gt_offset+gt_length,suffix);
+
+    serializationPool.run([&](int shard) {
+        uint8_t* position = objects_target + shardOffsets[shard];
+        for (int i = objects*shard/shards; i < objects*(shard+1)/shards; i++) {
+            const osi3::MovingObject& object = gt->moving_object(i);
+            position = CodedOutputStream::WriteVarint32ToArray(tag,position);
+            position = CodedOutputStream::WriteVarint32ToArray((uint32_t)object.GetCachedSize(),position);
+            position = object.SerializeWithCachedSizesToArray(position);
+        }
+    });
+
+    const char* buffer = sensorViewOut.publish();
+    normal_log("OSMP","Providing %08X %08X, writing from %p in %d shards ...",integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX],buffer,shards);
+}
 
 /*
- * ProtocolBuffer Accessors
+ * Trace Replay
  */
 
-void* decode_integer_to_pointer(fmi2Integer hi,fmi2Integer lo)
-{
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.base.lo=lo;
-    myaddr.base.hi=hi;
-    return reinterpret_cast<void*>(myaddr.address);
-#elif PTRDIFF_MAX == INT32_MAX
-    return reinterpret_cast<void*>(lo);
+bool TraceReader::open(const string& path)
+{
+    close();
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(f,&file_size) || file_size.QuadPart <= 0 || (unsigned long long)file_size.QuadPart > (unsigned long long)SIZE_MAX) {
+        CloseHandle(f);
+        return false;
+    }
+    HANDLE m = CreateFileMappingA(f,NULL,PAGE_READONLY,0,0,NULL);
+    if (m == NULL) {
+        CloseHandle(f);
+        return false;
+    }
+    void* view = MapViewOfFile(m,FILE_MAP_READ,0,0,0);
+    if (view == NULL) {
+        CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+    file = f;
+    mapping = m;
+    data = static_cast<const char*>(view);
+    size = (size_t)file_size.QuadPart;
 #else
-#error "Cannot determine 32bit or 64bit environment!"
+    int fd = ::open(path.c_str(),O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd,&st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > (unsigned long long)SIZE_MAX) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    ::close(fd);
+    if (view == MAP_FAILED)
+        return false;
+    data = static_cast<const char*>(view);
+    size = (size_t)st.st_size;
+    madvise(view,size,MADV_SEQUENTIAL);
 #endif
+    rewind();
+    return true;
 }
 
-void encode_pointer_to_integer(const void* ptr,fmi2Integer& hi,fmi2Integer& lo)
-{
-#if PTRDIFF_MAX == INT64_MAX
-    union addrconv {
-        struct {
-            int lo;
-            int hi;
-        } base;
-        unsigned long long address;
-    } myaddr;
-    myaddr.address=reinterpret_cast<unsigned long long>(ptr);
-    hi=myaddr.base.hi;
-    lo=myaddr.base.lo;
-#elif PTRDIFF_MAX == INT32_MAX
-    hi=0;
-    lo=reinterpret_cast<int>(ptr);
+void TraceReader::close()
+{
+    if (data == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    CloseHandle(file);
 #else
-#error "Cannot determine 32bit or 64bit environment!"
+    munmap(const_cast<char*>(data),size);
 #endif
+    data = NULL;
+    size = 0;
 }
 
-void COSMPDummySource::set_fmi_sensor_view_out(const osi3::SensorView& data)
+/* Returns the next frame, or false at the end of the trace (including a truncated last frame) */
+bool TraceReader::next(const char*& frame, size_t& frame_size)
 {
-    data.SerializeToString(currentBuffer);
-    encode_pointer_to_integer(currentBuffer->data(),integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX]);
-    integer_vars[FMI_INTEGER_SENSORVIEW_OUT_SIZE_IDX]=(fmi2Integer)currentBuffer->length();
-    normal_log("OSMP","Providing %08X %08X, writing from %p ...",integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX],integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX],currentBuffer->data());
-    swap(currentBuffer,lastBuffer);
+    if (size - position < 4)
+        return false;
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data+position);
+    size_t length = (size_t)header[0] | ((size_t)header[1] << 8) | ((size_t)header[2] << 16) | ((size_t)header[3] << 24);
+    if (length > size - position - 4 || length > INT_MAX)
+        return false;
+    previous = current;
+    current = position;
+    frame = data + position + 4;
+    frame_size = length;
+    position += 4 + length;
+    advise();
+    return true;
 }
 
-void COSMPDummySource::reset_fmi_sensor_view_out()
+void TraceReader::rewind()
+{
+    position = current = previous = 0;
+    advised = released = 0;
+    advise();
+}
+
+void TraceReader::advise()
 {
-    integer_vars[FMI_INTEGER_SENSORVIEW_OUT_SIZE_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX]=0;
-    integer_vars[FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX]=0;
+#ifndef _WIN32
+    while (advised < size && advised < position + TRACE_READAHEAD) {
+        size_t length = std::min((size_t)TRACE_READAHEAD, size - advised);
+        madvise(const_cast<char*>(data+advised),length,MADV_WILLNEED);
+        advised += length;
+    }
+    /* The frames handed out in this and the previous step must stay mapped */
+    while (released + TRACE_READAHEAD <= previous) {
+        madvise(const_cast<char*>(data+released),TRACE_READAHEAD,MADV_DONTNEED);
+        released += TRACE_READAHEAD;
+    }
+#endif
+}
+
+/*
+ * Counts the moving objects of a serialized SensorView by skipping
+ * over its fields without decoding them, returning -1 if it is
+ * malformed.  Ground truth may be split over several fragments.
+ */
+static int count_moving_objects(const char* data, size_t size)
+{
+    int count = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t tag;
+        size_t gt, gt_length;
+        if (!next_wire_field(data,pos,size,tag,gt,gt_length))
+            return -1;
+        if ((int)(tag >> 3) != osi3::SensorView::kGlobalGroundTruthFieldNumber || (tag & 7) != WIRETYPE_LENGTH_DELIMITED)
+            continue;
+        size_t gt_pos = gt;
+        while (gt_pos < gt + gt_length) {
+            size_t offset, length;
+            if (!next_wire_field(data,gt_pos,gt+gt_length,tag,offset,length))
+                return -1;
+            if ((int)(tag >> 3) == osi3::GroundTruth::kMovingObjectFieldNumber && (tag & 7) == WIRETYPE_LENGTH_DELIMITED)
+                count++;
+        }
+    }
+    return count;
+}
+
+/* Local path of a file URI such as the resource location, or an empty string for other URIs */
+static string file_uri_path(const string& uri)
+{
+    if (uri.compare(0,5,"file:") != 0)
+        return "";
+    string path = uri.substr(5);
+    if (path.compare(0,2,"//") == 0) {
+        size_t slash = path.find('/',2);
+        if (slash == string::npos)
+            return "";
+        path = path.substr(slash);
+    }
+    string decoded;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] == '%' && i+2 < path.size() && isxdigit((unsigned char)path[i+1]) && isxdigit((unsigned char)path[i+2])) {
+            decoded += (char)strtol(path.substr(i+1,2).c_str(),NULL,16);
+            i += 2;
+        } else {
+            decoded += path[i];
+        }
+    }
+#ifdef _WIN32
+    if (decoded.size() > 2 && decoded[0] == '/' && decoded[2] == ':')
+        decoded.erase(0,1);
+#endif
+    return decoded;
+}
+
+/* Resolves a relative trace file name against the resources directory of the FMU */
+static string trace_file_path(const string& name, const string& resources)
+{
+    if (name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':'))
+        return name;
+    string directory = file_uri_path(resources);
+    if (directory.empty())
+        return name;
+    if (directory[directory.size()-1] != '/' && directory[directory.size()-1] != '\\')
+        directory += '/';
+    return directory + name;
 }
 
 /*
@@ -140,6 +819,13 @@ fmi2Status COSMPDummySource::doInit()
     for (int i = 0; i<FMI_STRING_VARS; i++)
         string_vars[i] = "";
 
+    /* Parameters */
+    set_fmi_object_count(0);
+    set_fmi_lane_count(3);
+    set_fmi_seed(0);
+    set_fmi_motion_profile(MOTION_PROFILE_WEAVE);
+    set_fmi_serialization_threads(1);
+
     return fmi2OK;
 }
 
@@ -161,6 +847,97 @@ fmi2Status COSMPDummySource::doExitInitializationMode()
 {
     DEBUGBREAK();
 
+    if (fmi_object_count() < 0 || fmi_object_count() > TRAFFIC_MAX_OBJECTS) {
+        normal_log("OSI","Invalid object count %d, must be between 0 and %d",fmi_object_count(),TRAFFIC_MAX_OBJECTS);
+        return fmi2Error;
+    }
+    if (fmi_lane_count() < 1) {
+        normal_log("OSI","Invalid lane count %d, must be at least 1",fmi_lane_count());
+        return fmi2Error;
+    }
+    if (fmi_motion_profile() < MOTION_PROFILE_WEAVE || fmi_motion_profile() > MOTION_PROFILE_RING) {
+        normal_log("OSI","Invalid motion profile %d",fmi_motion_profile());
+        return fmi2Error;
+    }
+
+    if (fmi_serialization_threads() < 0 || fmi_serialization_threads() > SERIALIZATION_MAX_THREADS) {
+        normal_log("OSMP","Invalid number of serialization threads %d, must be between 0 and %d",fmi_serialization_threads(),SERIALIZATION_MAX_THREADS);
+        return fmi2Error;
+    }
+
+    trace.close();
+    traceFrames = 0;
+    if (!fmi_trace_file().empty()) {
+        string path = trace_file_path(fmi_trace_file(),fmuResourceLocation);
+        if (!trace.open(path)) {
+            normal_log("OSI","Unable to map trace file %s",path.c_str());
+            return fmi2Error;
+        }
+        normal_log("OSI","Replaying trace %s of %llu bytes",path.c_str(),trace.length());
+        return fmi2OK;
+    }
+
+    if (fmi_object_count() == 0) {
+        traffic.setup_default();
+        normal_log("OSI","Generating the built-in 10 vehicle scenario");
+    } else {
+        traffic.setup((size_t)fmi_object_count(),fmi_lane_count(),(unsigned int)fmi_seed(),fmi_motion_profile());
+        normal_log("OSI","Generating %d vehicles on %d lanes with seed %d, motion profile %d",fmi_object_count(),fmi_lane_count(),fmi_seed(),fmi_motion_profile());
+    }
+
+    /* Static parts of the SensorView, doCalc only updates the time-varying fields */
+    unsigned long long host_id = 10 + std::min<size_t>(4, traffic.size-1);
+    currentOut.Clear();
+    currentOut.mutable_version()->CopyFrom(osi3::InterfaceVersion::descriptor()->file()->options().GetExtension(osi3::current_interface_version));
+    currentOut.mutable_sensor_id()->set_value(10000);
+    currentOut.mutable_host_vehicle_id()->set_value(host_id);
+    osi3::GroundTruth *currentGT = currentOut.mutable_global_ground_truth();
+    currentGT->mutable_host_vehicle_id()->set_value(host_id);
+
+    // Vehicles
+    currentGT->mutable_moving_object()->Reserve((int)traffic.size);
+    for (size_t i=0;i<traffic.size;i++) {
+        osi3::MovingObject *veh = currentGT->add_moving_object();
+        veh->mutable_id()->set_value(10+i);
+        veh->set_type(osi3::MovingObject_Type_TYPE_VEHICLE);
+        auto vehclass = veh->mutable_vehicle_classification();
+        vehclass->set_type(traffic.type[i]);
+        auto vehlights = vehclass->mutable_light_state();
+        vehlights->set_indicator_state(osi3::MovingObject_VehicleClassification_LightState_IndicatorState_INDICATOR_STATE_OFF);
+        vehlights->set_brake_light_state(osi3::MovingObject_VehicleClassification_LightState_BrakeLightState_BRAKE_LIGHT_STATE_OFF);
+        veh->mutable_base()->mutable_dimension()->set_height(1.5);
+        veh->mutable_base()->mutable_dimension()->set_width(2.0);
+        veh->mutable_base()->mutable_dimension()->set_length(5.0);
+        veh->mutable_base()->mutable_position()->set_x(0.0);
+        veh->mutable_base()->mutable_position()->set_y(0.0);
+        veh->mutable_base()->mutable_position()->set_z(0.0);
+        veh->mutable_base()->mutable_velocity()->set_x(0.0);
+        veh->mutable_base()->mutable_velocity()->set_y(0.0);
+        veh->mutable_base()->mutable_velocity()->set_z(0.0);
+        veh->mutable_base()->mutable_acceleration()->set_x(0.0);
+        veh->mutable_base()->mutable_acceleration()->set_y(0.0);
+        veh->mutable_base()->mutable_acceleration()->set_z(0.0);
+        veh->mutable_base()->mutable_orientation()->set_pitch(0.0);
+        veh->mutable_base()->mutable_orientation()->set_roll(0.0);
+        veh->mutable_base()->mutable_orientation()->set_yaw(0.0);
+        veh->mutable_base()->mutable_orientation_rate()->set_pitch(0.0);
+        veh->mutable_base()->mutable_orientation_rate()->set_roll(0.0);
+        veh->mutable_base()->mutable_orientation_rate()->set_yaw(traffic.yaw_rate[i]);
+    }
+
+    int threads = fmi_serialization_threads();
+    if (threads == 0)
+        threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), SERIALIZATION_MAX_THREADS));
+    serializationPool.start(threads);
+
+    currentOutTemplate.clear();
+    if (fmi_template_patching()) {
+        if (currentOutTemplate.build(currentOut,traffic.size))
+            normal_log("OSMP","Patching a serialized template of %d bytes per step",(int)currentOutTemplate.size());
+        else
+            normal_log("OSMP","Unable to locate the time-varying fields in the serialized SensorView, serializing every step instead");
+    }
+
     return fmi2OK;
 }
 
@@ -187,70 +964,72 @@ fmi2Status COSMPDummySource::doCalc(fmi2Real currentCommunicationPoint, fmi2Real
 {
     DEBUGBREAK();
 
-    osi3::SensorView currentOut;
     double time = currentCommunicationPoint+communicationStepSize;
 
     normal_log("OSI","Calculating SensorView at %f for %f (step size %f)",currentCommunicationPoint,time,communicationStepSize);
 
+    /* Replay recorded SensorViews straight from the mapping, one frame per step */
+    if (trace.is_open()) {
+        const char* frame = NULL;
+        size_t frame_size = 0;
+        bool found = trace.next(frame,frame_size);
+        if (!found && fmi_trace_loop() && traceFrames > 0) {
+            normal_log("OSI","Restarting trace after %llu frames",traceFrames);
+            trace.rewind();
+            found = trace.next(frame,frame_size);
+        }
+        int objects = found ? count_moving_objects(frame,frame_size) : -1;
+        if (objects < 0) {
+            if (found)
+                normal_log("OSI","Skipping malformed SensorView in trace");
+            else
+                normal_log("OSI","End of trace after %llu frames",traceFrames);
+            reset_fmi_sensor_view_out();
+            set_fmi_valid(false);
+            set_fmi_count(0);
+            return fmi2OK;
+        }
+        traceFrames++;
+        map_fmi_sensor_view_out(frame,frame_size);
+        set_fmi_valid(true);
+        set_fmi_count(objects);
+        return fmi2OK;
+    }
+
     /* We act as GroundTruth Source */
-    static double source_y_offsets[10] = { 3.0, 3.0, 3.0, 0.25, 0, -0.25, -3.0, -3.0, -3.0, -3.0 };
-    static double source_x_offsets[10] = { 0.0, 40.0, 100.0, 100.0, 0.0, 150.0, 5.0, 45.0, 85.0, 125.0 };
-    static double source_x_speeds[10] = { 29.0, 30.0, 31.0, 25.0, 26.0, 28.0, 20.0, 22.0, 22.5, 23.0 };
-    static osi3::MovingObject_VehicleClassification_Type source_veh_types[10] = {
-        osi3::MovingObject_VehicleClassification_Type_TYPE_MEDIUM_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_SMALL_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_COMPACT_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_DELIVERY_VAN,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_LUXURY_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_MEDIUM_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_COMPACT_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_SMALL_CAR,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_MOTORBIKE,
-        osi3::MovingObject_VehicleClassification_Type_TYPE_BUS };
+    traffic.evaluate(time);
+
+    if (currentOutTemplate.valid()) {
+        patch_fmi_sensor_view_out(time);
+        set_fmi_valid(true);
+        set_fmi_count((fmi2Integer)traffic.size);
+        return fmi2OK;
+    }
 
-    currentOut.Clear();
-    currentOut.mutable_version()->CopyFrom(osi3::InterfaceVersion::descriptor()->file()->options().GetExtension(osi3::current_interface_version));
-    currentOut.mutable_sensor_id()->set_value(10000);
-    currentOut.mutable_host_vehicle_id()->set_value(14);
     osi3::GroundTruth *currentGT = currentOut.mutable_global_ground_truth();
     currentOut.mutable_timestamp()->set_seconds((long long int)floor(time));
     currentOut.mutable_timestamp()->set_nanos((int)((time - floor(time))*1000000000.0));
     currentGT->mutable_timestamp()->set_seconds((long long int)floor(time));
     currentGT->mutable_timestamp()->set_nanos((int)((time - floor(time))*1000000000.0));
-    currentGT->mutable_host_vehicle_id()->set_value(14);
 
     // Vehicles
-    for (unsigned int i=0;i<10;i++) {
-        osi3::MovingObject *veh = currentGT->add_moving_object();
-        veh->mutable_id()->set_value(10+i);
-        veh->set_type(osi3::MovingObject_Type_TYPE_VEHICLE);
-        auto vehclass = veh->mutable_vehicle_classification();
-        vehclass->set_type(source_veh_types[i]);
-        auto vehlights = vehclass->mutable_light_state();
-        vehlights->set_indicator_state(osi3::MovingObject_VehicleClassification_LightState_IndicatorState_INDICATOR_STATE_OFF);
-        vehlights->set_brake_light_state(osi3::MovingObject_VehicleClassification_LightState_BrakeLightState_BRAKE_LIGHT_STATE_OFF);
-        veh->mutable_base()->mutable_dimension()->set_height(1.5);
-        veh->mutable_base()->mutable_dimension()->set_width(2.0);
-        veh->mutable_base()->mutable_dimension()->set_length(5.0);
-        veh->mutable_base()->mutable_position()->set_x(source_x_offsets[i]+time*source_x_speeds[i]);
-        veh->mutable_base()->mutable_position()->set_y(source_y_offsets[i]+sin(time/source_x_speeds[i])*0.25);
-        veh->mutable_base()->mutable_position()->set_z(0.0);
-        veh->mutable_base()->mutable_velocity()->set_x(source_x_speeds[i]);
-        veh->mutable_base()->mutable_velocity()->set_y(cos(time/source_x_speeds[i])*0.25/source_x_speeds[i]);
-        veh->mutable_base()->mutable_velocity()->set_z(0.0);
-        veh->mutable_base()->mutable_acceleration()->set_x(0.0);
-        veh->mutable_base()->mutable_acceleration()->set_y(-sin(time/source_x_speeds[i])*0.25/(source_x_speeds[i]*source_x_speeds[i]));
-        veh->mutable_base()->mutable_acceleration()->set_z(0.0);
-        veh->mutable_base()->mutable_orientation()->set_pitch(0.0);
-        veh->mutable_base()->mutable_orientation()->set_roll(0.0);
-        veh->mutable_base()->mutable_orientation()->set_yaw(0.0);
-        veh->mutable_base()->mutable_orientation_rate()->set_pitch(0.0);
-        veh->mutable_base()->mutable_orientation_rate()->set_roll(0.0);
-        veh->mutable_base()->mutable_orientation_rate()->set_yaw(0.0);
-        normal_log("OSI","GT: Adding Vehicle %d[%llu] Absolute Position: %f,%f,%f Velocity (%f,%f,%f)",i,veh->id().value(),veh->base().position().x(),veh->base().position().y(),veh->base().position().z(),veh->base().velocity().x(),veh->base().velocity().y(),veh->base().velocity().z());
+    for (size_t i=0;i<traffic.size;i++) {
+        osi3::BaseMoving *base = currentGT->mutable_moving_object((int)i)->mutable_base();
+        base->mutable_position()->set_x(traffic.x[i]);
+        base->mutable_position()->set_y(traffic.y[i]);
+        base->mutable_velocity()->set_x(traffic.vx[i]);
+        base->mutable_velocity()->set_y(traffic.vy[i]);
+        base->mutable_acceleration()->set_x(traffic.ax[i]);
+        base->mutable_acceleration()->set_y(traffic.ay[i]);
+        if (traffic.profile == MOTION_PROFILE_RING)
+            base->mutable_orientation()->set_yaw(traffic.yaw[i]);
+        normal_log("OSI","GT: Moving Vehicle %d[%llu] Absolute Position: %f,%f,%f Velocity (%f,%f,%f)",(int)i,currentGT->moving_object((int)i).id().value(),base->position().x(),base->position().y(),base->position().z(),base->velocity().x(),base->velocity().y(),base->velocity().z());
     }
 
-    set_fmi_sensor_view_out(currentOut);
+    if (serializationPool.shards() > 1 && traffic.size >= SERIALIZATION_MIN_SHARDED_OBJECTS)
+        set_fmi_sensor_view_out_sharded(currentOut);
+    else
+        set_fmi_sensor_view_out(currentOut);
     set_fmi_valid(true);
     set_fmi_count(currentGT->moving_object_size());
     return fmi2OK;
@@ -265,6 +1044,10 @@ fmi2Status COSMPDummySource::doTerm()
 void COSMPDummySource::doFree()
 {
     DEBUGBREAK();
+    serializationPool.stop();
+    trace.close();
+    currentOut.Clear();
+    currentOutTemplate.clear();
 }
 
 /*
@@ -278,20 +1061,21 @@ COSMPDummySource::COSMPDummySource(fmi2String theinstanceName, fmi2Type thefmuTy
     fmuResourceLocation(thefmuResourceLocation),
     functions(*thefunctions),
     visible(!!thevisible),
-    loggingOn(!!theloggingOn)
+    loggingOn(!!theloggingOn),
+    sensorViewOut(integer_vars,65536),
+    traceFrames(0)
 {
-    currentBuffer = new string();
-    lastBuffer = new string();
-    loggingCategories.clear();
-    loggingCategories.insert("FMI");
-    loggingCategories.insert("OSMP");
-    loggingCategories.insert("OSI");
+    loggingCategories = LOG_CATEGORY_ALL;
+#ifdef PRIVATE_LOG_PATH
+    OSMPAsyncLogWriter::open(PRIVATE_LOG_PATH);
+#endif
 }
 
 COSMPDummySource::~COSMPDummySource()
 {
-    delete currentBuffer;
-    delete lastBuffer;
+#ifdef PRIVATE_LOG_PATH
+    OSMPAsyncLogWriter::close();
+#endif
 }
 
 fmi2Status COSMPDummySource::SetDebugLogging(fmi2Boolean theloggingOn, size_t nCategories, const fmi2String categories[])
@@ -299,20 +1083,11 @@ fmi2Status COSMPDummySource::SetDebugLogging(fmi2Boolean theloggingOn, size_t nC
     fmi_verbose_log("fmi2SetDebugLogging(%s)", theloggingOn ? "true" : "false");
     loggingOn = theloggingOn ? true : false;
     if (categories && (nCategories > 0)) {
-        loggingCategories.clear();
-        for (size_t i=0;i<nCategories;i++) {
-            if (0==strcmp(categories[i],"FMI"))
-                loggingCategories.insert("FMI");
-            else if (0==strcmp(categories[i],"OSMP"))
-                loggingCategories.insert("OSMP");
-            else if (0==strcmp(categories[i],"OSI"))
-                loggingCategories.insert("OSI");
-        }
+        loggingCategories = 0;
+        for (size_t i=0;i<nCategories;i++)
+            loggingCategories |= log_category(categories[i]);
     } else {
-        loggingCategories.clear();
-        loggingCategories.insert("FMI");
-        loggingCategories.insert("OSMP");
-        loggingCategories.insert("OSI");
+        loggingCategories = LOG_CATEGORY_ALL;
     }
     return fmi2OK;
 }
@@ -28,6 +28,17 @@ using namespace std;
  *   FMI calls is enabled, which can get very verbose.
  */
 
+/*
+ * Logging Categories
+ *
+ * Categories are kept as a bitmask, so that disabled log messages
+ * can be skipped before any formatting takes place.
+ */
+#define LOG_CATEGORY_FMI 0x1
+#define LOG_CATEGORY_OSMP 0x2
+#define LOG_CATEGORY_OSI 0x4
+#define LOG_CATEGORY_ALL (LOG_CATEGORY_FMI|LOG_CATEGORY_OSMP|LOG_CATEGORY_OSI)
+
 /*
  * Variable Definitions
  *
@@ -43,7 +54,9 @@ using namespace std;
 
 /* Boolean Variables */
 #define FMI_BOOLEAN_VALID_IDX 0
-#define FMI_BOOLEAN_LAST_IDX FMI_BOOLEAN_VALID_IDX
+#define FMI_BOOLEAN_TEMPLATE_PATCHING_IDX 1
+#define FMI_BOOLEAN_TRACE_LOOP_IDX 2
+#define FMI_BOOLEAN_LAST_IDX FMI_BOOLEAN_TRACE_LOOP_IDX
 #define FMI_BOOLEAN_VARS (FMI_BOOLEAN_LAST_IDX+1)
 
 /* Integer Variables */
@@ -51,26 +64,183 @@ using namespace std;
 #define FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX 1
 #define FMI_INTEGER_SENSORVIEW_OUT_SIZE_IDX 2
 #define FMI_INTEGER_COUNT_IDX 3
-#define FMI_INTEGER_LAST_IDX FMI_INTEGER_COUNT_IDX
+#define FMI_INTEGER_OBJECT_COUNT_IDX 4
+#define FMI_INTEGER_LANE_COUNT_IDX 5
+#define FMI_INTEGER_SEED_IDX 6
+#define FMI_INTEGER_MOTION_PROFILE_IDX 7
+#define FMI_INTEGER_SERIALIZATION_THREADS_IDX 8
+#define FMI_INTEGER_LAST_IDX FMI_INTEGER_SERIALIZATION_THREADS_IDX
 #define FMI_INTEGER_VARS (FMI_INTEGER_LAST_IDX+1)
 
+/* Motion Profiles */
+#define MOTION_PROFILE_WEAVE 0
+#define MOTION_PROFILE_STRAIGHT 1
+#define MOTION_PROFILE_RING 2
+
+/* Upper limit of the objectCount parameter */
+#define TRAFFIC_MAX_OBJECTS 100000
+
+/* Upper limit of the serializationThreads parameter, and the least number of objects worth sharding */
+#define SERIALIZATION_MAX_THREADS 64
+#define SERIALIZATION_MIN_SHARDED_OBJECTS 1000
+
+/* Amount of a replayed trace read ahead of the current frame, a multiple of the page size */
+#define TRACE_READAHEAD (32*1024*1024)
+
 /* Real Variables */
 #define FMI_REAL_LAST_IDX 0
 #define FMI_REAL_VARS (FMI_REAL_LAST_IDX+1)
 
 /* String Variables */
-#define FMI_STRING_LAST_IDX 0
+#define FMI_STRING_TRACE_FILE_IDX 0
+#define FMI_STRING_LAST_IDX FMI_STRING_TRACE_FILE_IDX
 #define FMI_STRING_VARS (FMI_STRING_LAST_IDX+1)
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <cstdarg>
-#include <set>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #undef min
 #undef max
 #include "osi_sensorview.pb.h"
+#include "OSMPBinaryVariable.h"
+#ifdef PRIVATE_LOG_PATH
+#include "OSMPAsyncLogWriter.h"
+#endif
+
+/*
+ * Traffic Generator
+ *
+ * Kinematic state of all generated vehicles as structure-of-arrays.
+ * Each vehicle is placed by its distance along the road (offset_x) and
+ * its lateral lane offset (offset_y), and drives at a constant speed;
+ * the motion profile decides whether the road is straight or a ring
+ * and whether vehicles weave within their lane.  evaluate() computes
+ * positions, velocities, accelerations and yaw of all vehicles at a
+ * given time in flat loops, with sine and cosine computed in batches
+ * by a branch-free polynomial approximation the compiler can vectorize.
+ * The built-in scenario uses the standard library functions instead,
+ * so that its output stays bit-identical to earlier versions.
+ */
+class TrafficGenerator {
+public:
+    void setup_default();
+    void setup(size_t count, int lanes, unsigned int seed, int profile);
+    void evaluate(double time);
+
+    size_t size;
+    int profile;
+    double ring_radius;
+    bool exact_trigonometry;
+    std::vector<osi3::MovingObject_VehicleClassification_Type> type;
+    std::vector<double> offset_x, offset_y, speed;
+    std::vector<double> angle, sin_angle, cos_angle;
+    std::vector<double> x, y, vx, vy, ax, ay, yaw, yaw_rate;
+
+protected:
+    void resize(size_t count);
+};
+
+/*
+ * Serialized Template
+ *
+ * The SensorView serialized once, together with the byte offsets of
+ * its time-varying fields, so that a step only copies the template to
+ * the output and patches those bytes instead of running the encoder.
+ * Positions, velocities, accelerations and yaw angles are doubles,
+ * i.e. fixed64 on the wire, and are overwritten in place.  Timestamps
+ * are varints of varying length, so they are left out of the template
+ * and appended as a trailing SensorView fragment with zero-padded
+ * varints of fixed length; parsers merge that fragment into the
+ * message serialized before it.
+ */
+class SensorViewTemplate {
+public:
+    bool build(const osi3::SensorView& view, size_t objects);
+    void write(char* target, double time, const TrafficGenerator& traffic) const;
+    void clear();
+    bool valid() const { return !bytes.empty(); }
+    size_t size() const { return bytes.size(); }
+
+protected:
+    std::string bytes;
+    std::vector<size_t> x, y, vx, vy, ax, ay, yaw;
+    size_t view_seconds, view_nanos, gt_seconds, gt_nanos;
+};
+
+/*
+ * Worker Pool
+ *
+ * Persistent threads that run a task once for each of a fixed number
+ * of shards, the calling thread taking the first shard itself.  run()
+ * returns once all shards are done, so tasks may refer to the caller's
+ * locals.
+ */
+class WorkerPool {
+public:
+    WorkerPool() : task(NULL), generation(0), pending(0), stopping(false) {}
+    ~WorkerPool() { stop(); }
+    void start(int shards);
+    void stop();
+    int shards() const { return (int)workers.size()+1; }
+    void run(const std::function<void(int)>& thetask);
+
+protected:
+    void work(int shard, unsigned long long seen);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable finished;
+    const std::function<void(int)>* task;
+    unsigned long long generation;
+    int pending;
+    bool stopping;
+};
+
+/*
+ * Trace Replay
+ *
+ * Read-only memory mapping of a recorded trace file of SensorViews,
+ * each preceded by its size as 4-byte little-endian integer, i.e. the
+ * .osi trace format, which the network proxy also writes to its
+ * logDataFile on little-endian hosts.  Frames are handed out as
+ * pointers into the mapping; the kernel is advised to read ahead of
+ * the current frame and to drop the pages well behind it.
+ */
+class TraceReader {
+public:
+    TraceReader() : data(NULL), size(0), position(0), current(0), previous(0), advised(0), released(0) {}
+    ~TraceReader() { close(); }
+    bool open(const std::string& path);
+    void close();
+    bool is_open() const { return data != NULL; }
+    unsigned long long length() const { return size; }
+    bool next(const char*& frame, size_t& frame_size);
+    void rewind();
+
+protected:
+    void advise();
+
+    const char* data;
+    size_t size;
+    size_t position;
+    size_t current;
+    size_t previous;
+    size_t advised;
+    size_t released;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#endif
+};
 
 /* FMU Class */
 class COSMPDummySource {
@@ -108,28 +278,52 @@ protected:
 
 protected:
     /* Private File-based Logging just for Debugging */
-#ifdef PRIVATE_LOG_PATH
-    static ofstream private_log_file;
-#endif
-
     static void fmi_verbose_log_global(const char* format, ...) {
 #ifdef VERBOSE_FMI_LOGGING
 #ifdef PRIVATE_LOG_PATH
         va_list ap;
         va_start(ap, format);
         char buffer[1024];
-        if (!private_log_file.is_open())
-            private_log_file.open(PRIVATE_LOG_PATH, ios::out | ios::app);
-        if (private_log_file.is_open()) {
 #ifdef _WIN32
-            vsnprintf_s(buffer, 1024, format, ap);
+        vsnprintf_s(buffer, 1024, _TRUNCATE, format, ap);
+#else
+        vsnprintf(buffer, 1024, format, ap);
+#endif
+        va_end(ap);
+        char line[1280];
+#ifdef _WIN32
+        int length = _snprintf_s(line, sizeof(line), _TRUNCATE, "OSMPDummySource::Global:FMI: %s", buffer);
 #else
-            vsnprintf(buffer, 1024, format, ap);
+        int length = snprintf(line, sizeof(line), "OSMPDummySource::Global:FMI: %s", buffer);
+#endif
+        if (length < 0 || length >= (int)sizeof(line))
+            length = (int)strlen(line);
+        /* Also called before the first and after the last instance, when the line is written synchronously */
+        OSMPAsyncLogWriter::write_unopened(PRIVATE_LOG_PATH, line, (size_t)length);
 #endif
-            private_log_file << "OSMPDummySource" << "::Global:FMI: " << buffer << endl;
-            private_log_file.flush();
-        }
 #endif
+    }
+
+    static unsigned int log_category(const char* category)
+    {
+        if (0==strcmp(category,"FMI"))
+            return LOG_CATEGORY_FMI;
+        else if (0==strcmp(category,"OSMP"))
+            return LOG_CATEGORY_OSMP;
+        else if (0==strcmp(category,"OSI"))
+            return LOG_CATEGORY_OSI;
+        return 0;
+    }
+
+    /* Checked before formatting:  Both the private log and the FMI logger honor loggingOn and the categories */
+    bool log_enabled(const char* category) const
+    {
+#if defined(PRIVATE_LOG_PATH)
+        return loggingOn && (loggingCategories & log_category(category)) != 0;
+#elif defined(PUBLIC_LOGGING)
+        return loggingOn && (loggingCategories & log_category(category)) != 0;
+#else
+        return false;
 #endif
     }
 
@@ -138,20 +332,23 @@ protected:
 #if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
         char buffer[1024];
 #ifdef _WIN32
-        vsnprintf_s(buffer, 1024, format, arg);
+        vsnprintf_s(buffer, 1024, _TRUNCATE, format, arg);
 #else
         vsnprintf(buffer, 1024, format, arg);
 #endif
 #ifdef PRIVATE_LOG_PATH
-        if (!private_log_file.is_open())
-            private_log_file.open(PRIVATE_LOG_PATH, ios::out | ios::app);
-        if (private_log_file.is_open()) {
-            private_log_file << "OSMPDummySource" << "::" << instanceName << "<" << ((void*)this) << ">:" << category << ": " << buffer << endl;
-            private_log_file.flush();
-        }
+        char line[1280];
+#ifdef _WIN32
+        int length = _snprintf_s(line, sizeof(line), _TRUNCATE, "OSMPDummySource::%s<%p>:%s: %s", instanceName.c_str(), (void*)this, category, buffer);
+#else
+        int length = snprintf(line, sizeof(line), "OSMPDummySource::%s<%p>:%s: %s", instanceName.c_str(), (void*)this, category, buffer);
+#endif
+        if (length < 0 || length >= (int)sizeof(line))
+            length = (int)strlen(line);
+        OSMPAsyncLogWriter::write(line, (size_t)length);
 #endif
 #ifdef PUBLIC_LOGGING
-        if (loggingOn && loggingCategories.count(category))
+        if (loggingOn && (loggingCategories & log_category(category)))
             functions.logger(functions.componentEnvironment,instanceName.c_str(),fmi2OK,category,buffer);
 #endif
 #endif
@@ -159,6 +356,8 @@ protected:
 
     void fmi_verbose_log(const char* format, ...) {
 #if  defined(VERBOSE_FMI_LOGGING) && (defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING))
+        if (!log_enabled("FMI"))
+            return;
         va_list ap;
         va_start(ap, format);
         internal_log("FMI",format,ap);
@@ -169,6 +368,8 @@ protected:
     /* Normal Logging */
     void normal_log(const char* category, const char* format, ...) {
 #if defined(PRIVATE_LOG_PATH) || defined(PUBLIC_LOGGING)
+        if (!log_enabled(category))
+            return;
         va_list ap;
         va_start(ap, format);
         internal_log(category,format,ap);
@@ -184,22 +385,50 @@ protected:
     string fmuResourceLocation;
     bool visible;
     bool loggingOn;
-    set<string> loggingCategories;
+    unsigned int loggingCategories;
     fmi2CallbackFunctions functions;
     fmi2Boolean boolean_vars[FMI_BOOLEAN_VARS];
     fmi2Integer integer_vars[FMI_INTEGER_VARS];
     fmi2Real real_vars[FMI_REAL_VARS];
     string string_vars[FMI_STRING_VARS];
-    string* currentBuffer;
-    string* lastBuffer;
+    OSMPBinaryOutput<osi3::SensorView,FMI_INTEGER_SENSORVIEW_OUT_BASELO_IDX,FMI_INTEGER_SENSORVIEW_OUT_BASEHI_IDX,FMI_INTEGER_SENSORVIEW_OUT_SIZE_IDX> sensorViewOut;
+    TrafficGenerator traffic;
+    /* Persistent SensorView, static parts are set up once in doExitInitializationMode */
+    osi3::SensorView currentOut;
+    SensorViewTemplate currentOutTemplate;
+    /* Sharded serialization of the moving objects */
+    WorkerPool serializationPool;
+    std::string shardedHeader;
+    std::vector<size_t> shardOffsets;
+    TraceReader trace;
+    unsigned long long traceFrames;
 
     /* Simple Accessors */
     fmi2Boolean fmi_valid() { return boolean_vars[FMI_BOOLEAN_VALID_IDX]; }
     void set_fmi_valid(fmi2Boolean value) { boolean_vars[FMI_BOOLEAN_VALID_IDX]=value; }
+    fmi2Boolean fmi_template_patching() { return boolean_vars[FMI_BOOLEAN_TEMPLATE_PATCHING_IDX]; }
+    void set_fmi_template_patching(fmi2Boolean value) { boolean_vars[FMI_BOOLEAN_TEMPLATE_PATCHING_IDX]=value; }
+    fmi2Boolean fmi_trace_loop() { return boolean_vars[FMI_BOOLEAN_TRACE_LOOP_IDX]; }
+    void set_fmi_trace_loop(fmi2Boolean value) { boolean_vars[FMI_BOOLEAN_TRACE_LOOP_IDX]=value; }
     fmi2Integer fmi_count() { return integer_vars[FMI_INTEGER_COUNT_IDX]; }
     void set_fmi_count(fmi2Integer value) { integer_vars[FMI_INTEGER_COUNT_IDX]=value; }
+    fmi2Integer fmi_object_count() { return integer_vars[FMI_INTEGER_OBJECT_COUNT_IDX]; }
+    void set_fmi_object_count(fmi2Integer value) { integer_vars[FMI_INTEGER_OBJECT_COUNT_IDX]=value; }
+    fmi2Integer fmi_lane_count() { return integer_vars[FMI_INTEGER_LANE_COUNT_IDX]; }
+    void set_fmi_lane_count(fmi2Integer value) { integer_vars[FMI_INTEGER_LANE_COUNT_IDX]=value; }
+    fmi2Integer fmi_seed() { return integer_vars[FMI_INTEGER_SEED_IDX]; }
+    void set_fmi_seed(fmi2Integer value) { integer_vars[FMI_INTEGER_SEED_IDX]=value; }
+    fmi2Integer fmi_motion_profile() { return integer_vars[FMI_INTEGER_MOTION_PROFILE_IDX]; }
+    void set_fmi_motion_profile(fmi2Integer value) { integer_vars[FMI_INTEGER_MOTION_PROFILE_IDX]=value; }
+    fmi2Integer fmi_serialization_threads() { return integer_vars[FMI_INTEGER_SERIALIZATION_THREADS_IDX]; }
+    void set_fmi_serialization_threads(fmi2Integer value) { integer_vars[FMI_INTEGER_SERIALIZATION_THREADS_IDX]=value; }
+    const string& fmi_trace_file() { return string_vars[FMI_STRING_TRACE_FILE_IDX]; }
+    void set_fmi_trace_file(const string& value) { string_vars[FMI_STRING_TRACE_FILE_IDX]=value; }
 
     /* Protocol Buffer Accessors */
     void set_fmi_sensor_view_out(const osi3::SensorView& data);
+    void patch_fmi_sensor_view_out(double time);
+    void set_fmi_sensor_view_out_sharded(osi3::SensorView& data);
+    void map_fmi_sensor_view_out(const char* data, size_t size);
     void reset_fmi_sensor_view_out();
 };
@@ -0,0 +1,177 @@
+/*
+ * PMSF FMU Framework for FMI 2.0 Co-Simulation FMUs
+ *
+ * (C) 2016 -- 2018 PMSF IT Consulting Pierre R. Mai
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef OSMPAsyncLogWriter_h
+#define OSMPAsyncLogWriter_h
+
+/*
+ * Asynchronous Log Writer
+ *
+ * Lines for the private log file are appended to an in-memory ring
+ * buffer, and written to the file by a background thread, so that
+ * logging does not stall the simulation step on file I/O.  When the
+ * ring buffer is full, lines are dropped (and the number of dropped
+ * lines is logged later) instead of blocking the caller.
+ *
+ * The writer is shared by all instances of an FMU:  It is started by
+ * the first call to open() and drained and stopped by the last
+ * matching call to close().  It has internal linkage, so that several
+ * FMUs loaded into the same process each get a writer of their own.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace {
+
+class OSMPAsyncLogWriter {
+public:
+    static void open(const char* path, size_t capacity = 1024*1024)
+    {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.users++ > 0)
+            return;
+        s.path = path;
+        s.ring.assign(capacity,'\0');
+        s.head = s.tail = 0;
+        s.dropped = 0;
+        s.stop = false;
+        s.thread = std::thread(run);
+    }
+
+    static void close()
+    {
+        State& s = state();
+        std::thread finished;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.users == 0 || --s.users > 0)
+                return;
+            s.stop = true;
+            finished.swap(s.thread);
+        }
+        s.wakeup.notify_one();
+        finished.join();
+    }
+
+    /* Appends a line (without line terminator), returns false if it was dropped */
+    static bool write(const char* line, size_t length)
+    {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.users == 0)
+            return false;
+        return append(s,line,length);
+    }
+
+    /* Like write(), but appends the line to path directly while no writer is open */
+    static bool write_unopened(const char* path, const char* line, size_t length)
+    {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.users > 0)
+            return append(s,line,length);
+        std::ofstream file(path, std::ios::out | std::ios::app);
+        if (!file.is_open())
+            return false;
+        file.write(line,length);
+        file << std::endl;
+        return true;
+    }
+
+private:
+    struct State {
+        State() : head(0), tail(0), dropped(0), stop(false), users(0) {}
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::thread thread;
+        std::string path;
+        std::vector<char> ring;
+        /* Total bytes ever read and written, positions are taken modulo the size */
+        size_t head, tail;
+        unsigned long long dropped;
+        bool stop;
+        int users;
+    };
+
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+
+    static bool append(State& s, const char* line, size_t length)
+    {
+        if (length+1 > s.ring.size()-(s.tail-s.head)) {
+            s.dropped++;
+            return false;
+        }
+        bool was_empty = s.head == s.tail;
+        put(s,line,length);
+        put(s,"\n",1);
+        if (was_empty)
+            s.wakeup.notify_one();
+        return true;
+    }
+
+    static void put(State& s, const char* data, size_t length)
+    {
+        size_t offset = s.tail % s.ring.size();
+        size_t first = std::min(length,s.ring.size()-offset);
+        memcpy(s.ring.data()+offset,data,first);
+        memcpy(s.ring.data(),data+first,length-first);
+        s.tail += length;
+    }
+
+    static void run()
+    {
+        State& s = state();
+        std::ofstream file(s.path.c_str(), std::ios::out | std::ios::app);
+        std::vector<char> chunk;
+        std::unique_lock<std::mutex> lock(s.mutex);
+        for (;;) {
+            s.wakeup.wait(lock,[&s] { return s.stop || s.head != s.tail; });
+            size_t length = s.tail-s.head;
+            size_t offset = s.head % s.ring.size();
+            size_t first = std::min(length,s.ring.size()-offset);
+            chunk.resize(length);
+            if (length > 0) {
+                memcpy(chunk.data(),s.ring.data()+offset,first);
+                memcpy(chunk.data()+first,s.ring.data(),length-first);
+            }
+            s.head = s.tail;
+            unsigned long long dropped = s.dropped;
+            s.dropped = 0;
+            bool stop = s.stop;
+            lock.unlock();
+            if (file.is_open()) {
+                if (length > 0)
+                    file.write(chunk.data(),length);
+                if (dropped > 0)
+                    file << "OSMPAsyncLogWriter: Dropped " << dropped << " log lines (buffer full)" << std::endl;
+                file.flush();
+            }
+            lock.lock();
+            if (stop && s.head == s.tail)
+                return;
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * PMSF FMU Framework for FMI 2.0 Co-Simulation FMUs
+ *
+ * (C) 2016 -- 2018 PMSF IT Consulting Pierre R. Mai
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef OSMPBinaryVariable_h
+#define OSMPBinaryVariable_h
+
+/*
+ * OSMP Binary Variables
+ *
+ * OSMP passes binary data (i.e. serialized OSI messages) between FMUs
+ * as triples of integer variables, giving the lower and upper 32 bits
+ * of the address of the data, and its size in bytes.  This header
+ * provides the shared handling of such variables:
+ *
+ * - Plain C functions to encode and decode addresses, and to get, set
+ *   and reset binary variables held in an integer variable array.
+ * - For C++ the OSMPBinaryInput and OSMPBinaryOutput templates, which
+ *   bind a message type to the indices of its variable triple at
+ *   compile time, and take care of parsing and serializing messages
+ *   without per-step allocations.
+ *
+ * The indices of a binary variable are always given in the order of
+ * the FMI_INTEGER_*_BASELO_IDX, *_BASEHI_IDX and *_SIZE_IDX defines.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fmi2TypesPlatform.h"
+
+#if defined(_MSC_VER) && !defined(__cplusplus)
+#define OSMP_INLINE static __inline
+#else
+#define OSMP_INLINE static inline
+#endif
+
+OSMP_INLINE void* decode_integer_to_pointer(fmi2Integer hi,fmi2Integer lo)
+{
+#if PTRDIFF_MAX == INT64_MAX
+    union addrconv {
+        struct {
+            int lo;
+            int hi;
+        } base;
+        unsigned long long address;
+    } myaddr;
+    myaddr.base.lo=lo;
+    myaddr.base.hi=hi;
+    return (void*)(myaddr.address);
+#elif PTRDIFF_MAX == INT32_MAX
+    return (void*)(lo);
+#else
+#error "Cannot determine 32bit or 64bit environment!"
+#endif
+}
+
+OSMP_INLINE void encode_pointer_to_integer(const void* ptr,fmi2Integer* hi,fmi2Integer* lo)
+{
+#if PTRDIFF_MAX == INT64_MAX
+    union addrconv {
+        struct {
+            int lo;
+            int hi;
+        } base;
+        unsigned long long address;
+    } myaddr;
+    myaddr.address=(unsigned long long)(ptr);
+    *hi=myaddr.base.hi;
+    *lo=myaddr.base.lo;
+#elif PTRDIFF_MAX == INT32_MAX
+    *hi=0;
+    *lo=(int)(ptr);
+#else
+#error "Cannot determine 32bit or 64bit environment!"
+#endif
+}
+
+/* Returns the data of a binary variable, or NULL if it holds no data */
+OSMP_INLINE const void* get_binary_variable(const fmi2Integer vars[], size_t baselo_idx, size_t basehi_idx, size_t size_idx, fmi2Integer* size)
+{
+    if (vars[size_idx] <= 0) {
+        *size = 0;
+        return NULL;
+    }
+    *size = vars[size_idx];
+    return decode_integer_to_pointer(vars[basehi_idx],vars[baselo_idx]);
+}
+
+OSMP_INLINE void set_binary_variable(fmi2Integer vars[], size_t baselo_idx, size_t basehi_idx, size_t size_idx, const void* data, fmi2Integer size)
+{
+    encode_pointer_to_integer(data,&vars[basehi_idx],&vars[baselo_idx]);
+    vars[size_idx]=size;
+}
+
+OSMP_INLINE void reset_binary_variable(fmi2Integer vars[], size_t baselo_idx, size_t basehi_idx, size_t size_idx)
+{
+    vars[size_idx]=0;
+    vars[basehi_idx]=0;
+    vars[baselo_idx]=0;
+}
+
+#ifdef __cplusplus
+
+#include <vector>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+/*
+ * Output Buffers
+ *
+ * Binary outputs are serialized into buffers that are allocated once
+ * and only ever grow (geometrically), so that steady-state steps
+ * neither reallocate nor copy them.
+ */
+class OutputBuffer {
+public:
+    explicit OutputBuffer(size_t initial_capacity = 0) : buffer(initial_capacity > 0 ? new char[initial_capacity] : NULL), used(0), capacity(initial_capacity) {}
+    ~OutputBuffer() { delete[] buffer; }
+    const char* data() const { return buffer; }
+    size_t length() const { return used; }
+    /* Sets the length of the buffer, returning its (uninitialized) contents */
+    char* resize(size_t size)
+    {
+        if (size > capacity) {
+            size_t new_capacity = capacity > 0 ? capacity : 4096;
+            while (new_capacity < size)
+                new_capacity *= 2;
+            delete[] buffer;
+            buffer = new char[new_capacity];
+            capacity = new_capacity;
+        }
+        used = size;
+        return buffer;
+    }
+
+private:
+    OutputBuffer(const OutputBuffer&);
+    OutputBuffer& operator=(const OutputBuffer&);
+
+    char* buffer;
+    size_t used;
+    size_t capacity;
+};
+
+/*
+ * Serializes a message into an output buffer, leaving room for extra
+ * bytes behind the message, and returns a pointer to that room.
+ */
+template<typename T> char* serialize_to_buffer(const T& data, OutputBuffer* buffer, size_t extra = 0)
+{
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+    size_t size = data.ByteSizeLong();
+#else
+    size_t size = data.ByteSize();
+#endif
+    char* target = buffer->resize(size+extra);
+    data.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(target));
+    return target+size;
+}
+
+/*
+ * Selective Decoding
+ *
+ * A FieldMask selects the fields of a message that are to be decoded,
+ * all other fields are skipped in place without being parsed.  Message
+ * fields can be given a nested FieldMask of their own, in which case
+ * they are decoded selectively, too.  Only fields numbered below 64 can
+ * be selected, higher-numbered fields (e.g. raw sensor views) are always
+ * skipped.
+ */
+class FieldMask {
+public:
+    explicit FieldMask(const google::protobuf::Descriptor* thedescriptor) : descriptor(thedescriptor), fields(0) {}
+
+    FieldMask& decode_field(int number)
+    {
+        if (number > 0 && number < 64)
+            fields |= 1ULL << number;
+        return *this;
+    }
+
+    FieldMask& decode_field_selectively(int number, const FieldMask* mask)
+    {
+        NestedMask entry;
+        entry.number = number;
+        entry.field = descriptor->FindFieldByNumber(number);
+        entry.mask = mask;
+        if (entry.field != NULL && entry.field->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+            nested.push_back(entry);
+        return *this;
+    }
+
+    bool parse(const void* data, int size, google::protobuf::Message& message) const
+    {
+        const uint8_t* base = static_cast<const uint8_t*>(data);
+        google::protobuf::io::CodedInputStream input(base,size);
+        message.Clear();
+        return merge(input,base,message) && input.ConsumedEntireMessage();
+    }
+
+protected:
+    bool merge(google::protobuf::io::CodedInputStream& input, const uint8_t* base, google::protobuf::Message& message) const
+    {
+        using google::protobuf::internal::WireFormatLite;
+
+        /*
+         * Consecutive selected fields are collected into runs, which are then
+         * merged into the message by the regular generated parser in one go.
+         */
+        int run_start = -1;
+        for (;;) {
+            int position = input.CurrentPosition();
+            uint32_t tag = input.ReadTag();
+            int number = WireFormatLite::GetTagFieldNumber(tag);
+            const NestedMask* nested_mask = NULL;
+            if (tag != 0 && WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+                for (size_t i = 0; i < nested.size(); i++)
+                    if (nested[i].number == number)
+                        nested_mask = &nested[i];
+            bool selected = tag != 0 && nested_mask == NULL && number < 64 && (fields & (1ULL << number));
+
+            if (run_start >= 0 && !selected) {
+                google::protobuf::io::CodedInputStream run(base+run_start,position-run_start);
+                if (!message.MergePartialFromCodedStream(&run))
+                    return false;
+                run_start = -1;
+            }
+
+            if (tag == 0)
+                return true;
+
+            if (nested_mask != NULL) {
+                uint32_t length;
+                if (!input.ReadVarint32(&length))
+                    return false;
+                google::protobuf::io::CodedInputStream::Limit limit = input.PushLimit(length);
+                const google::protobuf::Reflection* reflection = message.GetReflection();
+                google::protobuf::Message* submessage = nested_mask->field->is_repeated() ?
+                    reflection->AddMessage(&message,nested_mask->field) :
+                    reflection->MutableMessage(&message,nested_mask->field);
+                if (!nested_mask->mask->merge(input,base,*submessage) || !input.ConsumedEntireMessage())
+                    return false;
+                input.PopLimit(limit);
+            } else {
+                if (selected && run_start < 0)
+                    run_start = position;
+                if (!WireFormatLite::SkipField(&input,tag))
+                    return false;
+            }
+        }
+    }
+
+    struct NestedMask {
+        int number;
+        const google::protobuf::FieldDescriptor* field;
+        const FieldMask* mask;
+    };
+
+    const google::protobuf::Descriptor* descriptor;
+    uint64_t fields;
+    std::vector<NestedMask> nested;
+};
+
+/*
+ * Binary Inputs
+ *
+ * Decodes messages of type Msg from the binary variable at the given
+ * indices of an integer variable array.  The input owns a long-lived
+ * message that can be parsed into instead of a fresh one, so that the
+ * storage of the previous step (including that of repeated entries) is
+ * reused instead of being reallocated every step.
+ */
+template<typename Msg, size_t BaseLoIdx, size_t BaseHiIdx, size_t SizeIdx>
+class OSMPBinaryInput {
+public:
+    explicit OSMPBinaryInput(const fmi2Integer* thevars) : vars(thevars) {}
+
+    bool valid() const { return vars[SizeIdx] > 0; }
+    const void* data() const { return decode_integer_to_pointer(vars[BaseHiIdx],vars[BaseLoIdx]); }
+    size_t size() const { return valid() ? (size_t)vars[SizeIdx] : 0; }
+
+    /* Parses the input into the given message, optionally only the fields selected by mask */
+    bool parse(Msg& data, const FieldMask* mask = NULL) const
+    {
+        if (!valid())
+            return false;
+        if (mask != NULL)
+            return mask->parse(this->data(),(int)size(),data);
+        return data.ParseFromArray(this->data(),(int)size());
+    }
+
+    /* Parses the input into the long-lived message, returning NULL for invalid input */
+    Msg* get(const FieldMask* mask = NULL) { return parse(persistent,mask) ? &persistent : NULL; }
+    Msg& message() { return persistent; }
+
+private:
+    OSMPBinaryInput(const OSMPBinaryInput&);
+    OSMPBinaryInput& operator=(const OSMPBinaryInput&);
+
+    const fmi2Integer* vars;
+    Msg persistent;
+};
+
+/*
+ * Binary Outputs
+ *
+ * Provides messages of type Msg through the binary variable at the
+ * given indices of an integer variable array.  Outputs are double
+ * buffered:  Published data stays valid until the next but one call
+ * to publish(), i.e. until the step after it was provided.
+ */
+template<typename Msg, size_t BaseLoIdx, size_t BaseHiIdx, size_t SizeIdx>
+class OSMPBinaryOutput {
+public:
+    explicit OSMPBinaryOutput(fmi2Integer* thevars, size_t initial_capacity = 0) : vars(thevars), first(initial_capacity), second(initial_capacity), current(&first) {}
+
+    /*
+     * Serializes a message into the current buffer, leaving room for
+     * extra bytes behind it, and returns a pointer to that room.
+     */
+    char* serialize(const Msg& data, size_t extra = 0) { return serialize_to_buffer(data,current,extra); }
+    /* Resizes the current buffer for raw data, returning its (uninitialized) contents */
+    char* prepare(size_t size) { return current->resize(size); }
+
+    /* Provides the current buffer through the variables and switches buffers */
+    const char* publish()
+    {
+        const char* published = current->data();
+        set_binary_variable(vars,BaseLoIdx,BaseHiIdx,SizeIdx,published,(fmi2Integer)current->length());
+        current = (current == &first) ? &second : &first;
+        return published;
+    }
+
+    const char* set(const Msg& data)
+    {
+        serialize(data);
+        return publish();
+    }
+
+    void reset() { reset_binary_variable(vars,BaseLoIdx,BaseHiIdx,SizeIdx); }
+
+private:
+    OSMPBinaryOutput(const OSMPBinaryOutput&);
+    OSMPBinaryOutput& operator=(const OSMPBinaryOutput&);
+
+    fmi2Integer* vars;
+    OutputBuffer first;
+    OutputBuffer second;
+    OutputBuffer* current;
+};
+
+#endif
+
+#endif